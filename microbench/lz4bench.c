@@ -0,0 +1,516 @@
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Standalone benchmark of the lz4lite codec core.
+//
+// Built from '../src/lz4.c' and the R-free stream code in '../src/' only, 
+// so there is no R, GC or .Call overhead in the numbers.  Two paths are 
+// measured:
+//
+//   block  - each BUF_SIZE block compressed independently, as 'lz4_compress()'
+//   stream - the LZ4T stream written/read in R-sized chunks, as 
+//            'lz4_serialize()' and 'lz4_unserialize()'
+//
+// Usage: lz4bench [-s size] [-r reps] [-a acc] [-m mbps] [-t threads] [-c chunk] [-k isa] [file ...]
+//
+//   -s  size of each synthetic corpus in bytes (default 16777216)
+//   -r  timed repetitions per measurement (default 20)
+//   -a  LZ4 acceleration (default 1)
+//   -m  stream path only: adapt acceleration to this MB/s, starting 
+//       from '-a' (default 0, fixed acceleration)
+//   -t  comma separated thread counts for scaling (default 1,2,4)
+//   -c  bytes per stream read/write call (default 64768 = 8096 doubles)
+//   -k  LZ4 kernels to use: baseline, avx2 or avx512 (default: baseline)
+//
+// Any files given are benchmarked as captured corpora alongside the 
+// synthetic ones e.g. the output of 'serialize(x, NULL)' saved with 
+// 'writeBin()'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "lz4.h"
+#include "lz4-stream.h"
+#include "lz4-dispatch.h"
+
+typedef struct {
+  const char *name;
+  uint8_t *data;
+  int size;
+} corpus_t;
+
+typedef struct {
+  int size;
+  int reps;
+  int acc;
+  double target_mbps;
+  int chunk;
+  int threads[16];
+  int nthreads;
+} opts_t;
+
+static opts_t opts = {
+  .size     = 16 * 1024 * 1024,
+  .reps     = 20,
+  .acc      = 1,
+  .chunk    = 8096 * 8,
+  .threads  = {1, 2, 4},
+  .nthreads = 3
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Timing. Cycles from the TSC where available, otherwise nanoseconds
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline uint64_t now_cycles(void) {
+#ifdef HAVE_RDTSC
+  return __rdtsc();
+#else
+  return now_ns();
+#endif
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Synthetic corpora. A fixed seed so runs are comparable
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static inline uint64_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static uint8_t *corpus_alloc(int size) {
+  uint8_t *data = malloc(size);
+  if (data == NULL) {
+    fprintf(stderr, "Couldn't allocate corpus of %i bytes\n", size);
+    exit(1);
+  }
+  return data;
+}
+
+static corpus_t make_random(int size) {
+  uint8_t *data = corpus_alloc(size);
+  for (int i = 0; i < size; i++) data[i] = (uint8_t)rng();
+  return (corpus_t){"random", data, size};
+}
+
+static corpus_t make_zeros(int size) {
+  uint8_t *data = corpus_alloc(size);
+  memset(data, 0, size);
+  return (corpus_t){"zeros", data, size};
+}
+
+static corpus_t make_text(int size) {
+  static const char *words[] = {
+    "the", "of", "and", "data", "frame", "vector", "lz4", "compression",
+    "serialize", "value", "NA", "TRUE", "FALSE", "factor", "level", "x"
+  };
+  uint8_t *data = corpus_alloc(size);
+  int pos = 0;
+  while (pos < size) {
+    const char *word = words[rng() % 16];
+    int len = strlen(word);
+    for (int i = 0; i < len && pos < size; i++) data[pos++] = word[i];
+    if (pos < size) data[pos++] = (rng() % 12 == 0) ? '\n' : ' ';
+  }
+  return (corpus_t){"text", data, size};
+}
+
+static corpus_t make_doubles(int size) {
+  uint8_t *data = corpus_alloc(size);
+  double x = 100;
+  for (int i = 0; i + 8 <= size; i += 8) {
+    x += ((double)(rng() % 2001) - 1000) / 1000;
+    memcpy(data + i, &x, 8);
+  }
+  memset(data + (size / 8) * 8, 0, size % 8);
+  return (corpus_t){"doubles", data, size};
+}
+
+static corpus_t make_ints(int size) {
+  uint8_t *data = corpus_alloc(size);
+  for (int i = 0; i + 4 <= size; i += 4) {
+    int32_t x = rng() % 100;
+    memcpy(data + i, &x, 4);
+  }
+  memset(data + (size / 4) * 4, 0, size % 4);
+  return (corpus_t){"ints", data, size};
+}
+
+static corpus_t read_corpus(const char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "Couldn't open corpus file '%s'\n", filename);
+    exit(1);
+  }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  if (size <= 0 || size > INT32_MAX / 2) {
+    fprintf(stderr, "Corpus file '%s' is empty or too large\n", filename);
+    exit(1);
+  }
+  uint8_t *data = corpus_alloc(size);
+  if (fread(data, 1, size, fp) != size) {
+    fprintf(stderr, "Error reading corpus file '%s'\n", filename);
+    exit(1);
+  }
+  fclose(fp);
+  const char *base = strrchr(filename, '/');
+  return (corpus_t){base == NULL ? filename : base + 1, data, (int)size};
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Per-thread work.
+//
+// Each thread has its own contexts and buffers, and repeats the same 
+// operation 'reps' times over the whole corpus, timing each repetition.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define PATH_BLOCK   0
+#define PATH_STREAM  1
+
+typedef struct {
+  const corpus_t *corpus;
+  int path;
+  pthread_barrier_t *barrier;
+  
+  // Results
+  uint64_t *cycles_comp;   // per rep
+  uint64_t *cycles_decomp;
+  uint64_t *ns_comp;
+  uint64_t *ns_decomp;
+  int comp_size;
+  int failed;
+} work_t;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Block path: independent LZ4_compress_fast() per BUF_SIZE block
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void run_block(work_t *work) {
+  const corpus_t *corpus = work->corpus;
+  int nblocks  = (corpus->size + BUF_SIZE - 1) / BUF_SIZE;
+  int bound    = LZ4_COMPRESSBOUND(BUF_SIZE);
+  uint8_t *comp     = corpus_alloc(nblocks * bound);
+  int     *comp_len = calloc(nblocks, sizeof(int));
+  uint8_t *decomp   = corpus_alloc(corpus->size);
+  
+  for (int rep = 0; rep < opts.reps; rep++) {
+    pthread_barrier_wait(work->barrier);
+    uint64_t c0 = now_cycles(), t0 = now_ns();
+    int total = 0;
+    for (int b = 0; b < nblocks; b++) {
+      int len = b == nblocks - 1 ? corpus->size - b * BUF_SIZE : BUF_SIZE;
+      comp_len[b] = lz4_kernels.compress_fast(
+        (const char *)corpus->data + b * BUF_SIZE, (char *)comp + b * bound, 
+        len, bound, opts.acc
+      );
+      if (comp_len[b] <= 0) work->failed = 1;
+      total += comp_len[b];
+    }
+    work->cycles_comp[rep] = now_cycles() - c0;
+    work->ns_comp[rep]     = now_ns() - t0;
+    work->comp_size        = total;
+    
+    pthread_barrier_wait(work->barrier);
+    c0 = now_cycles(); t0 = now_ns();
+    for (int b = 0; b < nblocks; b++) {
+      int len = b == nblocks - 1 ? corpus->size - b * BUF_SIZE : BUF_SIZE;
+      int res = lz4_kernels.decompress_safe(
+        (const char *)comp + b * bound, (char *)decomp + b * BUF_SIZE, 
+        comp_len[b], len
+      );
+      if (res != len) work->failed = 1;
+    }
+    work->cycles_decomp[rep] = now_cycles() - c0;
+    work->ns_decomp[rep]     = now_ns() - t0;
+  }
+  
+  if (memcmp(decomp, corpus->data, corpus->size) != 0) work->failed = 1;
+  
+  free(comp);
+  free(comp_len);
+  free(decomp);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Stream path: db_write()/db_read() in chunks of 'opts.chunk' bytes
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int stream_compress(dbuf_t *db, const corpus_t *corpus) {
+  if (db_reset(db, MODE_SERIALIZE | MODE_RAW) < 0) return DB_ERROR;
+  db->acceleration = opts.acc;
+  db->target_mbps  = opts.target_mbps;
+  
+  for (int i = 0; i < corpus->size; i += opts.chunk) {
+    int len = corpus->size - i < opts.chunk ? corpus->size - i : opts.chunk;
+    if (db_write(db, corpus->data + i, len) < 0) return DB_ERROR;
+  }
+  if (db_write_block(db) < 0) return DB_ERROR;
+  return db->raw_pos;
+}
+
+static int stream_decompress(dbuf_t *db, uint8_t *src, int src_len, uint8_t *dst, int size) {
+  if (db_reset(db, MODE_UNSERIALIZE | MODE_RAW) < 0) return DB_ERROR;
+  db->raw          = src;
+  db->raw_capacity = src_len;
+  
+  for (int i = 0; i < size; i += opts.chunk) {
+    int len = size - i < opts.chunk ? size - i : opts.chunk;
+    if (db_read(db, dst + i, len) < 0) return DB_ERROR;
+  }
+  db->raw = NULL;
+  return 0;
+}
+
+static void run_stream(work_t *work) {
+  const corpus_t *corpus = work->corpus;
+  dbuf_t *writer = db_new();
+  dbuf_t *reader = db_new();
+  uint8_t *decomp = corpus_alloc(corpus->size);
+  if (writer == NULL || reader == NULL) {
+    fprintf(stderr, "Couldn't allocate stream contexts\n");
+    exit(1);
+  }
+  
+  for (int rep = 0; rep < opts.reps; rep++) {
+    pthread_barrier_wait(work->barrier);
+    uint64_t c0 = now_cycles(), t0 = now_ns();
+    int comp_size = stream_compress(writer, corpus);
+    work->cycles_comp[rep] = now_cycles() - c0;
+    work->ns_comp[rep]     = now_ns() - t0;
+    if (comp_size < 0) {
+      fprintf(stderr, "%s\n", writer->errmsg);
+      work->failed = 1;
+    }
+    work->comp_size = comp_size;
+    
+    pthread_barrier_wait(work->barrier);
+    c0 = now_cycles(); t0 = now_ns();
+    if (comp_size > 0 && stream_decompress(reader, writer->raw, comp_size, decomp, corpus->size) < 0) {
+      fprintf(stderr, "%s\n", reader->errmsg);
+      work->failed = 1;
+    }
+    work->cycles_decomp[rep] = now_cycles() - c0;
+    work->ns_decomp[rep]     = now_ns() - t0;
+    
+    // Keep the output buffer for the next repetition, as 'db_release()' does
+    writer->out          = writer->raw;
+    writer->out_capacity = writer->raw_capacity;
+    writer->raw          = NULL;
+  }
+  
+  if (memcmp(decomp, corpus->data, corpus->size) != 0) work->failed = 1;
+  
+  db_free(writer);
+  db_free(reader);
+  free(decomp);
+}
+
+static void *run_work(void *data) {
+  work_t *work = (work_t *)data;
+  if (work->path == PATH_BLOCK) {
+    run_block(work);
+  } else {
+    run_stream(work);
+  }
+  return NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Summaries
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const uint64_t *sorted, int n, double p) {
+  int i = (int)ceil(p * n) - 1;
+  if (i < 0) i = 0;
+  if (i >= n) i = n - 1;
+  return (double)sorted[i];
+}
+
+typedef struct {
+  double mbps;    // aggregate over all threads
+  double cpb;     // median cycles per byte
+  double p50, p90, p99, max; // latency in microseconds
+} summary_t;
+
+static summary_t summarise(uint64_t *cycles, uint64_t *ns, int n, int nthreads, double bytes) {
+  summary_t s;
+  qsort(cycles, n, sizeof(uint64_t), cmp_u64);
+  qsort(ns, n, sizeof(uint64_t), cmp_u64);
+  s.cpb  = percentile(cycles, n, 0.5) / bytes;
+  s.p50  = percentile(ns, n, 0.50) / 1e3;
+  s.p90  = percentile(ns, n, 0.90) / 1e3;
+  s.p99  = percentile(ns, n, 0.99) / 1e3;
+  s.max  = ns[n - 1] / 1e3;
+  s.mbps = nthreads * bytes / (s.p50 / 1e6) / 1e6;
+  return s;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Run one corpus/path with the given number of threads
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void bench(const corpus_t *corpus, int path, int nthreads, double *base_mbps) {
+  pthread_t         *threads = calloc(nthreads, sizeof(pthread_t));
+  work_t            *works   = calloc(nthreads, sizeof(work_t));
+  pthread_barrier_t  barrier;
+  pthread_barrier_init(&barrier, NULL, nthreads);
+  
+  int n = nthreads * opts.reps;
+  uint64_t *cc = calloc(n, sizeof(uint64_t)), *cd = calloc(n, sizeof(uint64_t));
+  uint64_t *nc = calloc(n, sizeof(uint64_t)), *nd = calloc(n, sizeof(uint64_t));
+  
+  for (int t = 0; t < nthreads; t++) {
+    works[t] = (work_t){
+      .corpus        = corpus,
+      .path          = path,
+      .barrier       = &barrier,
+      .cycles_comp   = cc + t * opts.reps,
+      .cycles_decomp = cd + t * opts.reps,
+      .ns_comp       = nc + t * opts.reps,
+      .ns_decomp     = nd + t * opts.reps
+    };
+    pthread_create(&threads[t], NULL, run_work, &works[t]);
+  }
+  
+  int failed = 0;
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+    failed |= works[t].failed;
+  }
+  
+  summary_t sc = summarise(cc, nc, n, nthreads, corpus->size);
+  summary_t sd = summarise(cd, nd, n, nthreads, corpus->size);
+  
+  if (nthreads == 1) {
+    base_mbps[0] = sc.mbps;
+    base_mbps[1] = sd.mbps;
+  }
+  
+  const char *path_name = path == PATH_BLOCK ? "block" : "stream";
+  double ratio = (double)corpus->size / works[0].comp_size;
+  
+  printf("%-12s %-6s %-10s %3i %7.2f %9.1f %7.3f %9.1f %9.1f %9.1f %9.1f %6.2f%s\n",
+         corpus->name, path_name, "compress", nthreads, ratio, sc.mbps, sc.cpb, 
+         sc.p50, sc.p90, sc.p99, sc.max, sc.mbps / (nthreads * base_mbps[0]),
+         failed ? "  FAILED" : "");
+  printf("%-12s %-6s %-10s %3i %7.2f %9.1f %7.3f %9.1f %9.1f %9.1f %9.1f %6.2f%s\n",
+         corpus->name, path_name, "decompress", nthreads, ratio, sd.mbps, sd.cpb, 
+         sd.p50, sd.p90, sd.p99, sd.max, sd.mbps / (nthreads * base_mbps[1]),
+         failed ? "  FAILED" : "");
+  
+  pthread_barrier_destroy(&barrier);
+  free(cc); free(cd); free(nc); free(nd);
+  free(threads);
+  free(works);
+}
+
+
+static void usage(void) {
+  fprintf(stderr, "Usage: lz4bench [-s size] [-r reps] [-a acc] [-m mbps] [-t threads] [-c chunk] [-k isa] [file ...]\n");
+  exit(1);
+}
+
+
+int main(int argc, char **argv) {
+  lz4_dispatch_init();
+  
+  int opt;
+  while ((opt = getopt(argc, argv, "s:r:a:m:t:c:k:h")) != -1) {
+    switch (opt) {
+    case 's': opts.size  = atoi(optarg); break;
+    case 'r': opts.reps  = atoi(optarg); break;
+    case 'a': opts.acc   = atoi(optarg); break;
+    case 'm': opts.target_mbps = atof(optarg); break;
+    case 'c': opts.chunk = atoi(optarg); break;
+    case 'k': 
+      if (lz4_dispatch_select(optarg) < 0) {
+        fprintf(stderr, "Kernels '%s' are not available on this CPU\n", optarg);
+        exit(1);
+      }
+      break;
+    case 't': {
+      opts.nthreads = 0;
+      char *tok = strtok(optarg, ",");
+      while (tok != NULL && opts.nthreads < 16) {
+        opts.threads[opts.nthreads++] = atoi(tok);
+        tok = strtok(NULL, ",");
+      }
+      break;
+    }
+    default: usage();
+    }
+  }
+  
+  if (opts.size <= 0 || opts.reps <= 0 || opts.acc <= 0 || opts.target_mbps < 0 || opts.nthreads == 0 ||
+      opts.chunk <= 0 || opts.chunk >= BUF_SIZE / 2) {
+    usage();
+  }
+  for (int i = 0; i < opts.nthreads; i++) {
+    if (opts.threads[i] <= 0) usage();
+  }
+  
+  int ncorpora = 5 + (argc - optind);
+  corpus_t *corpora = calloc(ncorpora, sizeof(corpus_t));
+  corpora[0] = make_random (opts.size);
+  corpora[1] = make_zeros  (opts.size);
+  corpora[2] = make_text   (opts.size);
+  corpora[3] = make_doubles(opts.size);
+  corpora[4] = make_ints   (opts.size);
+  for (int i = optind; i < argc; i++) {
+    corpora[5 + i - optind] = read_corpus(argv[i]);
+  }
+  
+#ifdef HAVE_RDTSC
+  const char *unit = "cyc/B";
+#else
+  const char *unit = "ns/B";
+#endif
+  
+  printf("# lz4 %s, kernels = %s, acc = %i, target_mbps = %g, reps = %i, chunk = %i\n", 
+         LZ4_versionString(), lz4_kernels.name, opts.acc, opts.target_mbps, opts.reps, opts.chunk);
+  printf("%-12s %-6s %-10s %3s %7s %9s %7s %9s %9s %9s %9s %6s\n",
+         "corpus", "path", "op", "thr", "ratio", "MB/s", unit, 
+         "p50_us", "p90_us", "p99_us", "max_us", "scale");
+  
+  for (int i = 0; i < ncorpora; i++) {
+    for (int path = PATH_BLOCK; path <= PATH_STREAM; path++) {
+      double base_mbps[2] = {0, 0};
+      for (int t = 0; t < opts.nthreads; t++) {
+        bench(&corpora[i], path, opts.threads[t], base_mbps);
+      }
+    }
+    free(corpora[i].data);
+  }
+  
+  free(corpora);
+  return 0;
+}
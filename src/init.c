@@ -3,22 +3,95 @@
 #include <R.h>
 #include <Rinternals.h>
 
-extern SEXP lz4_compress_(SEXP src_);
-extern SEXP lz4_decompress_(SEXP src_);
+extern SEXP lz4_compress_(SEXP src_, SEXP acc_, SEXP dict_, SEXP codec_, SEXP filter_);
+extern SEXP lz4_decompress_(SEXP src_, SEXP dict_, SEXP codec_);
+extern SEXP lz4_decompress_list_(SEXP src_, SEXP dict_, SEXP codec_, SEXP threads_);
+extern SEXP lz4_decompress_list_start_(SEXP src_, SEXP dict_, SEXP codec_, SEXP threads_);
+extern SEXP lz4_decompress_list_finish_(SEXP handle_);
 
-extern SEXP lz4_serialize_(SEXP x_, SEXP dst_, SEXP acc_, SEXP dict_);
-extern SEXP lz4_unserialize_(SEXP src_, SEXP dict_);
+extern SEXP lz4_serialize_(SEXP x_, SEXP dst_, SEXP acc_, SEXP dict_, SEXP codec_, SEXP typed_, SEXP target_mbps_);
+extern SEXP lz4_unserialize_(SEXP src_, SEXP dict_, SEXP codec_);
+
+extern SEXP lz4_codec_(SEXP acc_, SEXP dict_, SEXP block_size_, SEXP target_mbps_);
+extern SEXP lz4_estimate_(SEXP x_, SEXP acc_, SEXP sample_, SEXP typed_);
+
+extern SEXP lz4_writer_(SEXP dst_, SEXP acc_, SEXP dict_, SEXP codec_);
+extern SEXP lz4_writer_write_(SEXP handle_, SEXP x_);
+extern SEXP lz4_writer_serialize_(SEXP handle_, SEXP x_, SEXP typed_);
+extern SEXP lz4_writer_flush_(SEXP handle_);
+extern SEXP lz4_writer_close_(SEXP handle_);
+extern SEXP lz4_reader_(SEXP src_, SEXP dict_, SEXP codec_);
+extern SEXP lz4_reader_read_(SEXP handle_, SEXP n_);
+extern SEXP lz4_reader_unserialize_(SEXP handle_);
+extern SEXP lz4_reader_at_end_(SEXP handle_);
+extern SEXP lz4_reader_close_(SEXP handle_);
+
+extern SEXP lz4_archive_writer_(SEXP file_);
+extern SEXP lz4_archive_put_(SEXP aw_, SEXP key_, SEXP x_, SEXP acc_, SEXP dict_, SEXP codec_, SEXP typed_);
+extern SEXP lz4_archive_writer_close_(SEXP aw_);
+extern SEXP lz4_archive_open_(SEXP file_);
+extern SEXP lz4_archive_get_(SEXP ar_, SEXP keys_, SEXP dict_, SEXP codec_, SEXP threads_);
+extern SEXP lz4_archive_keys_(SEXP ar_);
+extern SEXP lz4_archive_close_(SEXP ar_);
+
+extern SEXP lz4_lazy_file_(SEXP type_, SEXP starts_, SEXP file_, SEXP offsets_, SEXP lengths_, SEXP cache_);
+extern SEXP lz4_lazy_memory_(SEXP type_, SEXP starts_, SEXP blocks_, SEXP cache_);
+
+extern SEXP lz4_stats_(SEXP enable_, SEXP reset_);
+extern SEXP lz4_trace_start_(SEXP max_events_);
+extern SEXP lz4_trace_stop_(SEXP file_);
+extern SEXP lz4_kernels_(SEXP isa_);
+
+extern void lz4_trace_free(void);
+
+extern void db_pool_free(void);
+extern void lz4_dispatch_init(void);
+extern void lz4_altrep_init(DllInfo *info);
+extern void lz4_lazy_init(DllInfo *info);
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // .C      R_CMethodDef
 // .Call   R_CallMethodDef
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 static const R_CallMethodDef CEntries[] = {
-  {"lz4_compress_"   , (DL_FUNC) &lz4_compress_   , 1},
-  {"lz4_decompress_" , (DL_FUNC) &lz4_decompress_ , 1},
+  {"lz4_compress_"              , (DL_FUNC) &lz4_compress_              , 5},
+  {"lz4_decompress_"            , (DL_FUNC) &lz4_decompress_            , 3},
+  {"lz4_decompress_list_"       , (DL_FUNC) &lz4_decompress_list_       , 4},
+  {"lz4_decompress_list_start_" , (DL_FUNC) &lz4_decompress_list_start_ , 4},
+  {"lz4_decompress_list_finish_", (DL_FUNC) &lz4_decompress_list_finish_, 1},
+  
+  {"lz4_serialize_"  , (DL_FUNC) &lz4_serialize_  , 7},
+  {"lz4_unserialize_", (DL_FUNC) &lz4_unserialize_, 3},
+  
+  {"lz4_codec_"      , (DL_FUNC) &lz4_codec_      , 4},
+  {"lz4_estimate_"   , (DL_FUNC) &lz4_estimate_   , 4},
+  
+  {"lz4_writer_"            , (DL_FUNC) &lz4_writer_            , 4},
+  {"lz4_writer_write_"      , (DL_FUNC) &lz4_writer_write_      , 2},
+  {"lz4_writer_serialize_"  , (DL_FUNC) &lz4_writer_serialize_  , 3},
+  {"lz4_writer_flush_"      , (DL_FUNC) &lz4_writer_flush_      , 1},
+  {"lz4_writer_close_"      , (DL_FUNC) &lz4_writer_close_      , 1},
+  {"lz4_reader_"            , (DL_FUNC) &lz4_reader_            , 3},
+  {"lz4_reader_read_"       , (DL_FUNC) &lz4_reader_read_       , 2},
+  {"lz4_reader_unserialize_", (DL_FUNC) &lz4_reader_unserialize_, 1},
+  {"lz4_reader_at_end_"     , (DL_FUNC) &lz4_reader_at_end_     , 1},
+  {"lz4_reader_close_"      , (DL_FUNC) &lz4_reader_close_      , 1},
   
-  {"lz4_serialize_"  , (DL_FUNC) &lz4_serialize_  , 4},
-  {"lz4_unserialize_", (DL_FUNC) &lz4_unserialize_, 2},
+  {"lz4_archive_writer_"      , (DL_FUNC) &lz4_archive_writer_      , 1},
+  {"lz4_archive_put_"         , (DL_FUNC) &lz4_archive_put_         , 7},
+  {"lz4_archive_writer_close_", (DL_FUNC) &lz4_archive_writer_close_, 1},
+  {"lz4_archive_open_"        , (DL_FUNC) &lz4_archive_open_        , 1},
+  {"lz4_archive_get_"         , (DL_FUNC) &lz4_archive_get_         , 5},
+  {"lz4_archive_keys_"        , (DL_FUNC) &lz4_archive_keys_        , 1},
+  {"lz4_archive_close_"       , (DL_FUNC) &lz4_archive_close_       , 1},
+  
+  {"lz4_lazy_file_"  , (DL_FUNC) &lz4_lazy_file_  , 6},
+  {"lz4_lazy_memory_", (DL_FUNC) &lz4_lazy_memory_, 4},
+  
+  {"lz4_stats_"      , (DL_FUNC) &lz4_stats_      , 2},
+  {"lz4_trace_start_", (DL_FUNC) &lz4_trace_start_, 1},
+  {"lz4_trace_stop_" , (DL_FUNC) &lz4_trace_stop_ , 1},
+  {"lz4_kernels_"    , (DL_FUNC) &lz4_kernels_    , 1},
   
   {NULL, NULL, 0}
 };
@@ -38,4 +111,22 @@ void R_init_lz4lite(DllInfo *info) {
     NULL       // External
   );
   R_useDynamicSymbols(info, FALSE);
+  
+  // Choose the fastest build of the LZ4 kernels for this CPU
+  lz4_dispatch_init();
+  
+  // ALTREP classes used when serializing with 'typed = TRUE'
+  lz4_altrep_init(info);
+  
+  // ALTREP classes for lazy vectors
+  lz4_lazy_init(info);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Free the pooled serialization contexts and trace buffer on unload
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void R_unload_lz4lite(DllInfo *info) {
+  db_pool_free();
+  lz4_trace_free();
 }
@@ -0,0 +1,145 @@
+
+#define R_NO_REMAP
+
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Altrep.h>
+
+#include <string.h>
+
+#include "lz4-altrep.h"
+#include "lz4-typed.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Vectors shorter than this are left to R's own serialization
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define TYPED_MIN_LENGTH 64
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// 'lz4_wrap_*' classes are transient wrappers around a vector which
+// only exist while an object is being serialized.
+//
+// R writes an ALTREP object as its class plus the result of its 
+// 'Serialized_state' method.  Here that state is a stored typed frame, a
+// raw vector which R writes in chunks of 8096 bytes.  The gain is that
+// strings become plain bytes, rather than each CHARSXP being written with
+// its own flags, length and (for short strings) separate small write.
+// On unserialize, R calls the class's 'Unserialize' method which rebuilds
+// an ordinary vector.
+//
+// data1: the wrapped vector
+// data2: raw vector holding the 'typed_filter_t' chosen when wrapping
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static R_altrep_class_t wrap_string_class;
+static R_altrep_class_t wrap_real_class;
+static R_altrep_class_t wrap_integer_class;
+
+
+static R_xlen_t wrap_Length(SEXP x_) {
+  return Rf_xlength(R_altrep_data1(x_));
+}
+
+
+static SEXP wrap_Serialized_state(SEXP x_) {
+  typed_filter_t filter;
+  memcpy(&filter, RAW(R_altrep_data2(x_)), sizeof(filter));
+  return typed_frame_stored(R_altrep_data1(x_), &filter);
+}
+
+
+static SEXP wrap_Unserialize(SEXP class_, SEXP state_) {
+  return typed_frame_unstore(state_);
+}
+
+
+static SEXP wrap_string_Elt(SEXP x_, R_xlen_t i) {
+  return STRING_ELT(R_altrep_data1(x_), i);
+}
+
+
+static void *wrap_real_Dataptr(SEXP x_, Rboolean writeable) {
+  return REAL(R_altrep_data1(x_));
+}
+
+
+static double wrap_real_Elt(SEXP x_, R_xlen_t i) {
+  return REAL(R_altrep_data1(x_))[i];
+}
+
+
+static void *wrap_integer_Dataptr(SEXP x_, Rboolean writeable) {
+  return INTEGER(R_altrep_data1(x_));
+}
+
+
+static int wrap_integer_Elt(SEXP x_, R_xlen_t i) {
+  return INTEGER(R_altrep_data1(x_))[i];
+}
+
+
+void lz4_altrep_init(DllInfo *info) {
+  wrap_string_class = R_make_altstring_class("lz4_wrap_string", "lz4lite", info);
+  R_set_altrep_Length_method          (wrap_string_class, wrap_Length);
+  R_set_altrep_Serialized_state_method(wrap_string_class, wrap_Serialized_state);
+  R_set_altrep_Unserialize_method     (wrap_string_class, wrap_Unserialize);
+  R_set_altstring_Elt_method          (wrap_string_class, wrap_string_Elt);
+
+  wrap_real_class = R_make_altreal_class("lz4_wrap_real", "lz4lite", info);
+  R_set_altrep_Length_method          (wrap_real_class, wrap_Length);
+  R_set_altrep_Serialized_state_method(wrap_real_class, wrap_Serialized_state);
+  R_set_altrep_Unserialize_method     (wrap_real_class, wrap_Unserialize);
+  R_set_altvec_Dataptr_method         (wrap_real_class, wrap_real_Dataptr);
+  R_set_altreal_Elt_method            (wrap_real_class, wrap_real_Elt);
+
+  wrap_integer_class = R_make_altinteger_class("lz4_wrap_integer", "lz4lite", info);
+  R_set_altrep_Length_method          (wrap_integer_class, wrap_Length);
+  R_set_altrep_Serialized_state_method(wrap_integer_class, wrap_Serialized_state);
+  R_set_altrep_Unserialize_method     (wrap_integer_class, wrap_Unserialize);
+  R_set_altvec_Dataptr_method         (wrap_integer_class, wrap_integer_Dataptr);
+  R_set_altinteger_Elt_method         (wrap_integer_class, wrap_integer_Elt);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Replace character, double and integer vectors within 'x_' by typed 
+// wrappers.  Numeric vectors which are already ALTREP (e.g. '1:n') are 
+// left alone as R already serializes them compactly.
+//
+// Lists (including data.frames) are shallow copied and searched 
+// recursively. The original object is never modified.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_typed_wrap(SEXP x_) {
+  if (TYPEOF(x_) == STRSXP || TYPEOF(x_) == REALSXP || TYPEOF(x_) == INTSXP) {
+    if (Rf_xlength(x_) < TYPED_MIN_LENGTH || (TYPEOF(x_) != STRSXP && ALTREP(x_))) {
+      return x_;
+    }
+    typed_filter_t filter = typed_filter(x_, R_NilValue);
+    if (!typed_fits(x_, &filter)) {
+      return x_;
+    }
+    SEXP filter_ = PROTECT(Rf_allocVector(RAWSXP, sizeof(filter)));
+    memcpy(RAW(filter_), &filter, sizeof(filter));
+    
+    R_altrep_class_t cls = 
+      TYPEOF(x_) == STRSXP  ? wrap_string_class :
+      TYPEOF(x_) == REALSXP ? wrap_real_class   : wrap_integer_class;
+    SEXP wrap_ = PROTECT(R_new_altrep(cls, x_, filter_));
+    SHALLOW_DUPLICATE_ATTRIB(wrap_, x_);
+    UNPROTECT(2);
+    return wrap_;
+  }
+
+  if (TYPEOF(x_) != VECSXP || ALTREP(x_)) {
+    return x_;
+  }
+
+  R_xlen_t n = Rf_xlength(x_);
+  SEXP res_ = PROTECT(Rf_shallow_duplicate(x_));
+  for (R_xlen_t i = 0; i < n; i++) {
+    SET_VECTOR_ELT(res_, i, lz4_typed_wrap(VECTOR_ELT(res_, i)));
+  }
+
+  UNPROTECT(1);
+  return res_;
+}
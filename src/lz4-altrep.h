@@ -0,0 +1,10 @@
+#ifndef LZ4_ALTREP_H
+#define LZ4_ALTREP_H
+
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+void lz4_altrep_init(DllInfo *info);
+SEXP lz4_typed_wrap(SEXP x_);
+
+#endif
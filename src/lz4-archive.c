@@ -0,0 +1,735 @@
+
+#define R_NO_REMAP
+
+#include <R.h>
+#include <Rinternals.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "lz4.h"
+#include "lz4-serialize.h"
+#include "lz4-codec.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Archive of many independently compressed objects in one file.
+//
+// Layout (all integers little-endian):
+//
+//   "LZ4A" uint32 version
+//   entry 0: a complete LZ4T stream, exactly as from 'lz4_serialize()'
+//   entry 1: ...
+//   (zero padding to a multiple of 8 bytes)
+//   index:
+//     uint64 n            number of entries
+//     uint64 nslots       size of the hash table (power of 2, >= 2n)
+//     uint32 slot[nslots] entry number + 1, or 0 for an empty slot
+//     (zero padding to a multiple of 8 bytes)
+//     ar_entry_t entry[n]
+//     uint8  keys[]       all keys (UTF-8) back to back
+//   trailer:
+//     uint64 index offset
+//     uint64 index length
+//     "LZ4A" uint32 version
+//
+// The index is laid out exactly as it is used in memory, so the file is
+// memory-mapped and a key is found by hashing and probing the slots,
+// without parsing or reading anything else.  Entries are separate streams,
+// so any one can be decoded alone, and several can be decoded in parallel.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define ARCHIVE_VERSION 1
+#define TRAILER_SIZE 24
+
+typedef struct {
+  uint64_t offset;      // Start of the entry's LZ4T stream in the file
+  uint64_t length;      // Compressed length of the entry
+  uint64_t key_offset;  // Start of the key within 'keys'
+  uint32_t key_len;
+  uint32_t hash;
+} ar_entry_t;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// FNV-1a
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static uint32_t ar_hash(const char *key, uint32_t len) {
+  uint32_t h = 2166136261u;
+  for (uint32_t i = 0; i < len; i++) {
+    h ^= (uint8_t)key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+static size_t pad8(size_t n) {
+  return (n + 7) & ~(size_t)7;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Find a key in a hash table. Returns the entry number, or -1
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int64_t ar_find(const uint32_t *slots, uint64_t nslots, const ar_entry_t *entries,
+                       uint64_t n, const uint8_t *keys, uint64_t keys_len,
+                       const char *key, uint32_t len, uint32_t hash) {
+  uint64_t mask = nslots - 1;
+  for (uint64_t i = hash & mask, probes = 0; probes < nslots; i = (i + 1) & mask, probes++) {
+    uint32_t s = slots[i];
+    if (s == 0 || s > n) return -1;
+    const ar_entry_t *e = &entries[s - 1];
+    if (e->hash == hash && e->key_len == len && e->key_offset <= keys_len &&
+        len <= keys_len - e->key_offset &&
+        memcmp(keys + e->key_offset, key, len) == 0) {
+      return s - 1;
+    }
+  }
+  return -1;
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//    #   #           #     #
+//    #   #                 #
+//    #   #  # ##    ##    ####    ###
+//    # # #  ##  #    #     #     #   #
+//    # # #  #        #     #     #####
+//    ## ##  #        #     #  #  #
+//    #   #  #       ###     ##    ###
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  FILE *file;
+  uint64_t pos;        // Bytes written so far
+
+  ar_entry_t *entries;
+  uint64_t n;
+  uint64_t capacity;
+
+  uint8_t *keys;
+  uint64_t keys_len;
+  uint64_t keys_capacity;
+
+  uint32_t *slots;     // Kept up to date so duplicate keys are caught on 'put'
+  uint64_t nslots;
+} ar_writer_t;
+
+
+static void ar_writer_free(ar_writer_t *aw) {
+  if (aw == NULL) return;
+  if (aw->file != NULL) fclose(aw->file);
+  free(aw->entries);
+  free(aw->keys);
+  free(aw->slots);
+  free(aw);
+}
+
+
+static void ar_writer_finalizer(SEXP aw_) {
+  ar_writer_free((ar_writer_t *)R_ExternalPtrAddr(aw_));
+  R_ClearExternalPtr(aw_);
+}
+
+
+static ar_writer_t *ar_writer_get(SEXP aw_) {
+  if (TYPEOF(aw_) != EXTPTRSXP || !Rf_inherits(aw_, "lz4_archive_writer_handle")) {
+    Rf_error("Not an lz4 archive writer");
+  }
+  ar_writer_t *aw = (ar_writer_t *)R_ExternalPtrAddr(aw_);
+  if (aw == NULL) {
+    Rf_error("Archive has been closed");
+  }
+  return aw;
+}
+
+
+static int ar_write(ar_writer_t *aw, const void *src, size_t len) {
+  if (len > 0 && fwrite(src, 1, len, aw->file) != len) return -1;
+  aw->pos += len;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Double the hash table and re-insert every entry
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int ar_writer_rehash(ar_writer_t *aw) {
+  uint64_t nslots = aw->nslots == 0 ? 1024 : 2 * aw->nslots;
+  uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+  if (slots == NULL) return -1;
+  for (uint64_t i = 0; i < aw->n; i++) {
+    uint64_t j = aw->entries[i].hash & (nslots - 1);
+    while (slots[j] != 0) j = (j + 1) & (nslots - 1);
+    slots[j] = (uint32_t)(i + 1);
+  }
+  free(aw->slots);
+  aw->slots  = slots;
+  aw->nslots = nslots;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Create an archive file for writing
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_archive_writer_(SEXP file_) {
+  if (TYPEOF(file_) != STRSXP || Rf_length(file_) != 1 || STRING_ELT(file_, 0) == NA_STRING) {
+    Rf_error("'file' must be a single file name");
+  }
+
+  ar_writer_t *aw = calloc(1, sizeof(ar_writer_t));
+  if (aw == NULL) {
+    Rf_error("Couldn't allocate archive writer");
+  }
+  SEXP aw_ = PROTECT(R_MakeExternalPtr(aw, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(aw_, ar_writer_finalizer, TRUE);
+  Rf_setAttrib(aw_, R_ClassSymbol, Rf_mkString("lz4_archive_writer_handle"));
+
+  const char *filename = R_ExpandFileName(CHAR(STRING_ELT(file_, 0)));
+  aw->file = fopen(filename, "wb");
+  if (aw->file == NULL) {
+    Rf_error("Couldn't open file for output: '%s'", filename);
+  }
+
+  uint32_t version = ARCHIVE_VERSION;
+  if (ar_write(aw, "LZ4A", 4) < 0 || ar_write(aw, &version, 4) < 0 ||
+      ar_writer_rehash(aw) < 0) {
+    Rf_error("Error writing to file");
+  }
+
+  UNPROTECT(1);
+  return aw_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Serialize an object and append it to the archive under 'key_'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_archive_put_(SEXP aw_, SEXP key_, SEXP x_, SEXP acc_, SEXP dict_, SEXP codec_, SEXP typed_) {
+  ar_writer_t *aw = ar_writer_get(aw_);
+
+  if (TYPEOF(key_) != STRSXP || Rf_length(key_) != 1 || STRING_ELT(key_, 0) == NA_STRING) {
+    Rf_error("'key' must be a single string");
+  }
+  const char *key = Rf_translateCharUTF8(STRING_ELT(key_, 0));
+  size_t len = strlen(key);
+  if (len > UINT32_MAX) {
+    Rf_error("'key' is too long");
+  }
+  uint32_t hash = ar_hash(key, (uint32_t)len);
+  if (ar_find(aw->slots, aw->nslots, aw->entries, aw->n, aw->keys, aw->keys_len,
+              key, (uint32_t)len, hash) >= 0) {
+    Rf_error("Duplicate key: '%s'", key);
+  }
+  if (aw->n >= UINT32_MAX - 1) {
+    Rf_error("Too many entries in archive");
+  }
+
+  SEXP enc_ = PROTECT(lz4_serialize_(x_, R_NilValue, acc_, dict_, codec_, typed_, R_NilValue));
+
+  // Grow the entries, keys and hash table as needed
+  if (aw->n == aw->capacity) {
+    uint64_t capacity = aw->capacity == 0 ? 1024 : 2 * aw->capacity;
+    ar_entry_t *entries = realloc(aw->entries, capacity * sizeof(ar_entry_t));
+    if (entries == NULL) Rf_error("Couldn't allocate archive index");
+    aw->entries  = entries;
+    aw->capacity = capacity;
+  }
+  if (aw->keys_len + len > aw->keys_capacity) {
+    uint64_t capacity = 2 * (aw->keys_len + len) + 4096;
+    uint8_t *keys = realloc(aw->keys, capacity);
+    if (keys == NULL) Rf_error("Couldn't allocate archive index");
+    aw->keys          = keys;
+    aw->keys_capacity = capacity;
+  }
+  if (2 * (aw->n + 1) > aw->nslots && ar_writer_rehash(aw) < 0) {
+    Rf_error("Couldn't allocate archive index");
+  }
+
+  ar_entry_t *e = &aw->entries[aw->n];
+  e->offset     = aw->pos;
+  e->length     = (uint64_t)Rf_xlength(enc_);
+  e->key_offset = aw->keys_len;
+  e->key_len    = (uint32_t)len;
+  e->hash       = hash;
+  if (ar_write(aw, RAW(enc_), (size_t)e->length) < 0) {
+    Rf_error("Error writing to file");
+  }
+
+  memcpy(aw->keys + aw->keys_len, key, len);
+  aw->keys_len += len;
+
+  uint64_t j = hash & (aw->nslots - 1);
+  while (aw->slots[j] != 0) j = (j + 1) & (aw->nslots - 1);
+  aw->n++;
+  aw->slots[j] = (uint32_t)aw->n;
+
+  UNPROTECT(1);
+  return R_NilValue;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write the index and trailer, and close the file
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_archive_writer_close_(SEXP aw_) {
+  ar_writer_t *aw = ar_writer_get(aw_);
+
+  static const uint8_t zeros[8] = {0};
+  uint32_t version = ARCHIVE_VERSION;
+
+  bool ok = ar_write(aw, zeros, pad8(aw->pos) - aw->pos) == 0;
+  uint64_t index_offset = aw->pos;
+
+  ok = ok &&
+    ar_write(aw, &aw->n     , sizeof(uint64_t)) == 0 &&
+    ar_write(aw, &aw->nslots, sizeof(uint64_t)) == 0 &&
+    ar_write(aw, aw->slots  , aw->nslots * sizeof(uint32_t)) == 0 &&
+    ar_write(aw, zeros      , pad8(aw->pos) - aw->pos) == 0 &&
+    ar_write(aw, aw->entries, aw->n * sizeof(ar_entry_t)) == 0 &&
+    ar_write(aw, aw->keys   , aw->keys_len) == 0;
+
+  uint64_t index_length = aw->pos - index_offset;
+  ok = ok &&
+    ar_write(aw, &index_offset, sizeof(uint64_t)) == 0 &&
+    ar_write(aw, &index_length, sizeof(uint64_t)) == 0 &&
+    ar_write(aw, "LZ4A"       , 4) == 0 &&
+    ar_write(aw, &version     , 4) == 0;
+
+  int status = fclose(aw->file);
+  aw->file = NULL;
+  ar_writer_free(aw);
+  R_ClearExternalPtr(aw_);
+
+  if (!ok || status != 0) {
+    Rf_error("Error writing to file");
+  }
+  return R_NilValue;
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//  ####                     #
+//  #   #                    #
+//  #   #   ###    ###    ## #
+//  ####   #   #      #  #  ##
+//  # #    #####   ####  #   #
+//  #  #   #      #   #  #  ##
+//  #   #   ###    ####   ## #
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  uint8_t *map;        // Whole file, if memory-mapped
+  size_t map_len;
+  FILE *file;          // Otherwise entries are read from the file
+  uint8_t *index;      // Points into 'map', or malloc'd
+
+  uint64_t n;
+  uint64_t nslots;
+  const uint32_t *slots;
+  const ar_entry_t *entries;
+  const uint8_t *keys;
+  uint64_t keys_len;
+} archive_t;
+
+
+static void archive_free(archive_t *ar) {
+  if (ar == NULL) return;
+#ifndef _WIN32
+  if (ar->map != NULL) munmap(ar->map, ar->map_len);
+#endif
+  if (ar->map == NULL) free(ar->index);
+  if (ar->file != NULL) fclose(ar->file);
+  free(ar);
+}
+
+
+static void archive_finalizer(SEXP ar_) {
+  archive_free((archive_t *)R_ExternalPtrAddr(ar_));
+  R_ClearExternalPtr(ar_);
+}
+
+
+static archive_t *archive_get(SEXP ar_) {
+  if (TYPEOF(ar_) != EXTPTRSXP || !Rf_inherits(ar_, "lz4_archive_handle")) {
+    Rf_error("Not an lz4 archive");
+  }
+  archive_t *ar = (archive_t *)R_ExternalPtrAddr(ar_);
+  if (ar == NULL) {
+    Rf_error("Archive has been closed");
+  }
+  return ar;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Open an archive.
+// The file is memory-mapped where possible. On Windows, only the index is
+// read into memory and entries are read from the file as needed.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_archive_open_(SEXP file_) {
+  if (TYPEOF(file_) != STRSXP || Rf_length(file_) != 1 || STRING_ELT(file_, 0) == NA_STRING) {
+    Rf_error("'file' must be a single file name");
+  }
+  const char *filename = R_ExpandFileName(CHAR(STRING_ELT(file_, 0)));
+
+  archive_t *ar = calloc(1, sizeof(archive_t));
+  if (ar == NULL) {
+    Rf_error("Couldn't allocate archive");
+  }
+  SEXP ar_ = PROTECT(R_MakeExternalPtr(ar, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ar_, archive_finalizer, TRUE);
+  Rf_setAttrib(ar_, R_ClassSymbol, Rf_mkString("lz4_archive_handle"));
+
+  uint8_t header[8], trailer[TRAILER_SIZE];
+  uint64_t index_offset, index_length, file_len;
+
+#ifndef _WIN32
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    Rf_error("Couldn't open file for input: '%s'", filename);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 8 + TRAILER_SIZE) {
+    close(fd);
+    Rf_error("File is not an lz4 archive: '%s'", filename);
+  }
+  file_len = (uint64_t)st.st_size;
+  void *map = mmap(NULL, (size_t)file_len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    Rf_error("Couldn't map file: '%s'", filename);
+  }
+  ar->map     = (uint8_t *)map;
+  ar->map_len = (size_t)file_len;
+  memcpy(header , ar->map, 8);
+  memcpy(trailer, ar->map + file_len - TRAILER_SIZE, TRAILER_SIZE);
+#else
+  ar->file = fopen(filename, "rb");
+  if (ar->file == NULL) {
+    Rf_error("Couldn't open file for input: '%s'", filename);
+  }
+  if (_fseeki64(ar->file, 0, SEEK_END) != 0 || (file_len = (uint64_t)_ftelli64(ar->file)) < 8 + TRAILER_SIZE ||
+      _fseeki64(ar->file, 0, SEEK_SET) != 0 || fread(header, 1, 8, ar->file) != 8 ||
+      _fseeki64(ar->file, -TRAILER_SIZE, SEEK_END) != 0 ||
+      fread(trailer, 1, TRAILER_SIZE, ar->file) != TRAILER_SIZE) {
+    Rf_error("File is not an lz4 archive: '%s'", filename);
+  }
+#endif
+
+  uint32_t version;
+  memcpy(&index_offset, trailer    , 8);
+  memcpy(&index_length, trailer + 8, 8);
+  memcpy(&version     , trailer + 20, 4);
+  if (memcmp(header, "LZ4A", 4) != 0 || memcmp(trailer + 16, "LZ4A", 4) != 0) {
+    Rf_error("File is not an lz4 archive: '%s'", filename);
+  }
+  if (version != ARCHIVE_VERSION) {
+    Rf_error("Unsupported lz4 archive version: %u", version);
+  }
+  if (index_offset % 8 != 0 || index_length < 16 ||
+      index_offset + index_length != file_len - TRAILER_SIZE) {
+    Rf_error("Corrupt lz4 archive index");
+  }
+
+#ifndef _WIN32
+  ar->index = ar->map + index_offset;
+#else
+  ar->index = malloc((size_t)index_length);
+  if (ar->index == NULL) {
+    Rf_error("Couldn't allocate archive index");
+  }
+  if (_fseeki64(ar->file, (int64_t)index_offset, SEEK_SET) != 0 ||
+      fread(ar->index, 1, (size_t)index_length, ar->file) != index_length) {
+    Rf_error("Error reading archive index");
+  }
+#endif
+
+  memcpy(&ar->n     , ar->index    , 8);
+  memcpy(&ar->nslots, ar->index + 8, 8);
+  uint64_t slots_len   = pad8(ar->nslots * sizeof(uint32_t));
+  uint64_t entries_len = ar->n * sizeof(ar_entry_t);
+  if (ar->nslots < 2 * ar->n || (ar->nslots & (ar->nslots - 1)) != 0 ||
+      ar->nslots > index_length || ar->n > index_length ||
+      16 + slots_len + entries_len > index_length) {
+    Rf_error("Corrupt lz4 archive index");
+  }
+  ar->slots    = (const uint32_t *)(ar->index + 16);
+  ar->entries  = (const ar_entry_t *)(ar->index + 16 + slots_len);
+  ar->keys     = ar->index + 16 + slots_len + entries_len;
+  ar->keys_len = index_length - 16 - slots_len - entries_len;
+
+  UNPROTECT(1);
+  return ar_;
+}
+
+
+SEXP lz4_archive_close_(SEXP ar_) {
+  archive_free(archive_get(ar_));
+  R_ClearExternalPtr(ar_);
+  return R_NilValue;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// All keys, in the order they were written
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_archive_keys_(SEXP ar_) {
+  archive_t *ar = archive_get(ar_);
+  if (ar->n > R_XLEN_T_MAX) {
+    Rf_error("Too many keys");
+  }
+
+  SEXP keys_ = PROTECT(Rf_allocVector(STRSXP, (R_xlen_t)ar->n));
+  for (uint64_t i = 0; i < ar->n; i++) {
+    const ar_entry_t *e = &ar->entries[i];
+    if (e->key_offset > ar->keys_len || e->key_len > ar->keys_len - e->key_offset) {
+      Rf_error("Corrupt lz4 archive index");
+    }
+    SET_STRING_ELT(keys_, (R_xlen_t)i,
+                   Rf_mkCharLenCE((const char *)ar->keys + e->key_offset, (int)e->key_len, CE_UTF8));
+  }
+  UNPROTECT(1);
+  return keys_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Total uncompressed length of an LZ4T (or LZ4S) stream, from its block headers.
+// Returns -1 if the stream is malformed
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int64_t ar_stream_length(const uint8_t *src, uint64_t len) {
+  if (len < 4 || db_check_magic(src) < 0) return -1;
+  int64_t total = 0;
+  uint64_t pos = 4;
+  while (pos < len) {
+    uint32_t header;
+    int32_t comp_len;
+    if (len - pos < 8) return -1;
+    memcpy(&header  , src + pos    , 4);
+    memcpy(&comp_len, src + pos + 4, 4);
+    pos += 8;
+    if (comp_len < 0 || (uint64_t)comp_len > len - pos) return -1;
+    pos   += (uint64_t)comp_len;
+    total += header & BLOCK_LEN_MASK;
+  }
+  return total;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decode an entry into R's serialized bytes.
+// Blocks are decompressed back to back into 'dst', so each has the previous
+// one as its prefix.  No R API is used, so this runs on worker threads.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int ar_decode(dbuf_t *db, const uint8_t *src, uint64_t len,
+                     const char *dict, int dict_size, uint8_t *dst, int64_t dst_len) {
+  if (db == NULL || db_reset(db, MODE_UNSERIALIZE | MODE_RAW) < 0) return DB_ERROR;
+  db->raw          = (uint8_t *)src;
+  db->raw_capacity = (int)len;
+  if (dict != NULL) {
+    LZ4_setStreamDecode(db->stream_in, dict, dict_size);
+  }
+
+  int64_t pos = 0;
+  while (db->raw_pos == 0 || db->raw_pos < db->raw_capacity) {
+    int comp_len = db_read_block(db);
+    if (comp_len < 0) return DB_ERROR;
+    if (db->block_len > dst_len - pos) return DB_ERROR;
+    if (db_decompress_block(db, comp_len, dst + pos, (int)(dst_len - pos < INT_MAX ? dst_len - pos : INT_MAX)) < 0) {
+      return DB_ERROR;
+    }
+    pos += db->block_len;
+  }
+  db->raw = NULL;
+  return pos == dst_len ? 0 : DB_ERROR;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// R unserialization from decoded bytes in memory
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  const uint8_t *data;
+  R_xlen_t len;
+  R_xlen_t pos;
+} ar_input_t;
+
+
+static int ar_read_byte(R_inpstream_t stream) {
+  Rf_error("'ar_read_byte()' is never called");
+  return 0;
+}
+
+
+static void ar_read_bytes(R_inpstream_t stream, void *dst, int length) {
+  ar_input_t *in = (ar_input_t *)stream->data;
+  if (length > in->len - in->pos) {
+    Rf_error("Unexpected end of archive entry");
+  }
+  memcpy(dst, in->data + in->pos, length);
+  in->pos += length;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Get objects by key.
+//
+// Keys are looked up and memory for the decoded bytes allocated here,
+// then all entries are decompressed in parallel, then each is
+// unserialized (which must be done on this thread).
+//
+// @param ar_ archive
+// @param keys_ character vector
+// @param dict_ raw vector or NULL
+// @param codec_ codec or NULL. Overrides 'dict_'
+// @param threads_ maximum number of threads to decompress with
+//
+// @return list of objects, one for each key
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_archive_get_(SEXP ar_, SEXP keys_, SEXP dict_, SEXP codec_, SEXP threads_) {
+  archive_t *ar = archive_get(ar_);
+
+  if (TYPEOF(keys_) != STRSXP) {
+    Rf_error("'key' must be a character vector");
+  }
+  int threads = Rf_asInteger(threads_);
+  if (threads == NA_INTEGER || threads < 1) {
+    Rf_error("'threads' must be a positive integer");
+  }
+
+  lz4_codec_t *codec = lz4_codec_get(codec_);
+  if (codec != NULL) {
+    dict_ = codec->dict_;
+  } else if (!Rf_isNull(dict_) && TYPEOF(dict_) != RAWSXP) {
+    Rf_error("Dictionary must be raw() vector or NULL");
+  }
+  const char *dict = TYPEOF(dict_) == RAWSXP && Rf_length(dict_) > 0 ? (const char *)RAW(dict_) : NULL;
+  int dict_size    = dict == NULL ? 0 : Rf_length(dict_);
+
+  R_xlen_t n = Rf_xlength(keys_);
+  SEXP res_  = PROTECT(Rf_allocVector(VECSXP, n));  // Decoded bytes, then objects
+  SEXP comp_ = PROTECT(Rf_allocVector(VECSXP, n));  // Entries read from the file (Windows)
+  const uint8_t **src = (const uint8_t **)R_alloc((size_t)n + 1, sizeof(uint8_t *));
+  uint64_t      *len  = (uint64_t *)R_alloc((size_t)n + 1, sizeof(uint64_t));
+  uint8_t      **dst  = (uint8_t **)R_alloc((size_t)n + 1, sizeof(uint8_t *));
+  int64_t    *dst_len = (int64_t *)R_alloc((size_t)n + 1, sizeof(int64_t));
+  int         *status = (int *)R_alloc((size_t)n + 1, sizeof(int));
+
+  for (R_xlen_t i = 0; i < n; i++) {
+    SEXP key_ = STRING_ELT(keys_, i);
+    if (key_ == NA_STRING) {
+      Rf_error("'key' must not be NA");
+    }
+    const char *key = Rf_translateCharUTF8(key_);
+    uint32_t klen   = (uint32_t)strlen(key);
+    int64_t idx = ar_find(ar->slots, ar->nslots, ar->entries, ar->n, ar->keys, ar->keys_len,
+                          key, klen, ar_hash(key, klen));
+    if (idx < 0) {
+      Rf_error("Key not found: '%s'", key);
+    }
+
+    const ar_entry_t *e = &ar->entries[idx];
+    if (e->length > INT_MAX) {
+      Rf_error("Corrupt lz4 archive entry: '%s'", key);
+    }
+    len[i] = e->length;
+#ifndef _WIN32
+    if (e->offset > ar->map_len || e->length > ar->map_len - e->offset) {
+      Rf_error("Corrupt lz4 archive entry: '%s'", key);
+    }
+    src[i] = ar->map + e->offset;
+#else
+    SET_VECTOR_ELT(comp_, i, Rf_allocVector(RAWSXP, (R_xlen_t)e->length));
+    if (_fseeki64(ar->file, (int64_t)e->offset, SEEK_SET) != 0 ||
+        fread(RAW(VECTOR_ELT(comp_, i)), 1, (size_t)e->length, ar->file) != e->length) {
+      Rf_error("Error reading lz4 archive entry: '%s'", key);
+    }
+    src[i] = RAW(VECTOR_ELT(comp_, i));
+#endif
+
+    int64_t raw_len = ar_stream_length(src[i], len[i]);
+    if (raw_len < 0 || raw_len > R_XLEN_T_MAX) {
+      Rf_error("Corrupt lz4 archive entry: '%s'", key);
+    }
+    SET_VECTOR_ELT(res_, i, Rf_allocVector(RAWSXP, (R_xlen_t)raw_len));
+    dst[i]     = RAW(VECTOR_ELT(res_, i));
+    dst_len[i] = raw_len;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Decompress. Each thread has its own context; the calling thread uses
+  // one from the pool so that a single 'get' allocates nothing.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  dbuf_t *pooled = db_acquire(MODE_UNSERIALIZE, NULL);
+  if (threads > n) threads = n < 1 ? 1 : (int)n;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(threads)
+#endif
+  {
+#ifdef _OPENMP
+    bool main_thread = omp_get_thread_num() == 0;
+#else
+    bool main_thread = true;
+#endif
+    dbuf_t *db = main_thread ? pooled : db_new();
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (R_xlen_t i = 0; i < n; i++) {
+      status[i] = ar_decode(db, src[i], len[i], dict, dict_size, dst[i], dst_len[i]);
+    }
+
+    if (!main_thread && db != NULL) db_free(db);
+  }
+
+  db_release(pooled, false);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Unserialize
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  for (R_xlen_t i = 0; i < n; i++) {
+    if (status[i] < 0) {
+      Rf_error("Error decompressing lz4 archive entry: '%s'",
+               Rf_translateCharUTF8(STRING_ELT(keys_, i)));
+    }
+    SET_VECTOR_ELT(comp_, i, R_NilValue);
+
+    ar_input_t in = {
+      .data = dst[i],
+      .len  = (R_xlen_t)dst_len[i],
+      .pos  = 0
+    };
+    struct R_inpstream_st input_stream;
+    R_InitInPStream(
+      &input_stream,
+      (R_pstream_data_t) &in,
+      R_pstream_any_format,
+      ar_read_byte,
+      ar_read_bytes,
+      NULL,
+      NULL
+    );
+    SET_VECTOR_ELT(res_, i, R_Unserialize(&input_stream));
+  }
+
+  UNPROTECT(2);
+  return res_;
+}
@@ -0,0 +1,12 @@
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// lz4.c built for AVX2.  
+//
+// The literal and match copies in lz4.c are fixed size memcpy()s, which 
+// the compiler turns into single 32 byte moves for this target
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define LZ4LITE_VARIANT        avx2
+#define LZ4LITE_VARIANT_STRING "avx2"
+#define LZ4LITE_VARIANT_TARGET "avx2,bmi,bmi2"
+
+#include "lz4-variant.h"
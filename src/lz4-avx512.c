@@ -0,0 +1,11 @@
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// lz4.c built for AVX-512 (F + BW + VL). 
+//
+// As for AVX2, but with 64 byte registers available for the wide copies
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define LZ4LITE_VARIANT        avx512
+#define LZ4LITE_VARIANT_STRING "avx512"
+#define LZ4LITE_VARIANT_TARGET "avx512f,avx512bw,avx512vl,avx2,bmi,bmi2"
+
+#include "lz4-variant.h"
@@ -0,0 +1,226 @@
+
+#include <limits.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "lz4-bitpack.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Frame-of-reference bit-packing.  
+//
+// Nothing in this file depends on R. 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#define ROWS (BITPACK_BLOCK / 4)
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Pack 128 values of 'b' bits into 4 * b words.
+// Row j holds values [4j, 4j + 3], one per lane.
+// Unpacking adds 'base' to each value.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#if defined(__SSE2__)
+static void pack128(const uint32_t *in, int b, uint32_t *out) {
+  __m128i acc = _mm_setzero_si128();
+  int shift = 0;
+  for (int j = 0; j < ROWS; j++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + 4 * j));
+    acc = _mm_or_si128(acc, _mm_sll_epi32(v, _mm_cvtsi32_si128(shift)));
+    shift += b;
+    if (shift >= 32) {
+      _mm_storeu_si128((__m128i *)out, acc);
+      out += 4;
+      shift -= 32;
+      acc = shift ? _mm_srl_epi32(v, _mm_cvtsi32_si128(b - shift)) : _mm_setzero_si128();
+    }
+  }
+}
+
+
+static void unpack128(const uint32_t *in, int b, uint32_t base, uint32_t *out) {
+  __m128i mask = _mm_set1_epi32(b == 32 ? -1 : (int)((1u << b) - 1));
+  __m128i vbase = _mm_set1_epi32((int)base);
+  __m128i cur  = _mm_loadu_si128((const __m128i *)in);
+  int shift = 0;
+  for (int j = 0; j < ROWS; j++) {
+    __m128i v = _mm_srl_epi32(cur, _mm_cvtsi32_si128(shift));
+    shift += b;
+    if (shift >= 32 && j < ROWS - 1) {
+      in += 4;
+      cur = _mm_loadu_si128((const __m128i *)in);
+      shift -= 32;
+      if (shift) {
+        v = _mm_or_si128(v, _mm_sll_epi32(cur, _mm_cvtsi32_si128(b - shift)));
+      }
+    }
+    v = _mm_add_epi32(_mm_and_si128(v, mask), vbase);
+    _mm_storeu_si128((__m128i *)(out + 4 * j), v);
+  }
+}
+#else
+static void pack128(const uint32_t *in, int b, uint32_t *out) {
+  uint32_t acc[4] = {0, 0, 0, 0};
+  int shift = 0;
+  for (int j = 0; j < ROWS; j++) {
+    const uint32_t *v = in + 4 * j;
+    for (int k = 0; k < 4; k++) acc[k] |= v[k] << shift;
+    shift += b;
+    if (shift >= 32) {
+      memcpy(out, acc, sizeof(acc));
+      out += 4;
+      shift -= 32;
+      for (int k = 0; k < 4; k++) acc[k] = shift ? v[k] >> (b - shift) : 0;
+    }
+  }
+}
+
+
+static void unpack128(const uint32_t *in, int b, uint32_t base, uint32_t *out) {
+  uint32_t mask = b == 32 ? UINT32_MAX : (1u << b) - 1;
+  const uint32_t *cur = in;
+  int shift = 0;
+  for (int j = 0; j < ROWS; j++) {
+    uint32_t v[4];
+    for (int k = 0; k < 4; k++) v[k] = shift < 32 ? cur[k] >> shift : 0;
+    shift += b;
+    if (shift >= 32 && j < ROWS - 1) {
+      cur += 4;
+      shift -= 32;
+      if (shift) {
+        for (int k = 0; k < 4; k++) v[k] |= cur[k] << (b - shift);
+      }
+    }
+    for (int k = 0; k < 4; k++) out[4 * j + k] = (v[k] & mask) + base;
+  }
+}
+#endif
+
+
+static int bit_width(uint32_t range) {
+  return range == 0 ? 0 : 32 - __builtin_clz(range);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Maximum encoded size of 'n' values
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t bitpack_bound(int n) {
+  size_t nblocks = ((size_t)n + BITPACK_BLOCK - 1) / BITPACK_BLOCK;
+  return nblocks * (BITPACK_HEADER + BITPACK_BLOCK * sizeof(int32_t));
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Encode 'n' values into 'dst' (which must hold 'bitpack_bound(n)' bytes).
+// Returns the number of bytes written
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t bitpack_encode(const int32_t *x, int n, char *dst) {
+  char *out = dst;
+  uint32_t block[BITPACK_BLOCK];
+  uint32_t packed[BITPACK_BLOCK];
+
+  for (int i0 = 0; i0 < n; i0 += BITPACK_BLOCK) {
+    int m = n - i0 < BITPACK_BLOCK ? n - i0 : BITPACK_BLOCK;
+    const int32_t *v = x + i0;
+
+    // Range of the non-NA values
+    int32_t min = INT_MAX, max = INT_MIN;
+    int has_na = 0;
+    for (int j = 0; j < m; j++) {
+      if (v[j] == INT_MIN) {
+        has_na = 1;
+      } else {
+        min = v[j] < min ? v[j] : min;
+        max = v[j] > max ? v[j] : max;
+      }
+    }
+    if (min > max) {
+      min = max = 0;  // All NA
+    }
+
+    uint32_t range = (uint32_t)max - (uint32_t)min;
+    uint32_t na    = range + 1;
+    int b = bit_width(has_na ? na : range);
+
+    for (int j = 0; j < m; j++) {
+      block[j] = v[j] == INT_MIN ? na : (uint32_t)v[j] - (uint32_t)min;
+    }
+    memset(block + m, 0, (size_t)(BITPACK_BLOCK - m) * sizeof(uint32_t));
+
+    memcpy(out, &min, sizeof(int32_t));
+    out[4] = (char)b;
+    out[5] = (char)(has_na ? BITPACK_HAS_NA : 0);
+    out += BITPACK_HEADER;
+
+    if (b > 0) {
+      pack128(block, b, packed);
+      memcpy(out, packed, (size_t)b * 4 * sizeof(uint32_t));
+      out += (size_t)b * 4 * sizeof(uint32_t);
+    }
+  }
+
+  return (size_t)(out - dst);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decode 'n' values.  Returns BITPACK_ERROR if 'src' is not exactly 'len' 
+// bytes of valid blocks.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int bitpack_decode(int32_t *x, int n, const char *src, size_t len) {
+  const char *in  = src;
+  const char *end = src + len;
+  uint32_t packed[BITPACK_BLOCK];
+  uint32_t block[BITPACK_BLOCK];
+
+  for (int i0 = 0; i0 < n; i0 += BITPACK_BLOCK) {
+    int m = n - i0 < BITPACK_BLOCK ? n - i0 : BITPACK_BLOCK;
+
+    if (end - in < BITPACK_HEADER) {
+      return BITPACK_ERROR;
+    }
+    int32_t min;
+    memcpy(&min, in, sizeof(int32_t));
+    int b      = (uint8_t)in[4];
+    int has_na = in[5] & BITPACK_HAS_NA;
+    in += BITPACK_HEADER;
+
+    size_t nbytes = (size_t)b * 4 * sizeof(uint32_t);
+    if (b > 32 || (size_t)(end - in) < nbytes) {
+      return BITPACK_ERROR;
+    }
+
+    int32_t *v = x + i0;
+    if (b == 0) {
+      for (int j = 0; j < m; j++) v[j] = min;
+      continue;
+    }
+
+    memcpy(packed, in, nbytes);
+    in += nbytes;
+
+    if (!has_na) {
+      // Full blocks are unpacked straight into the output
+      if (m == BITPACK_BLOCK) {
+        unpack128(packed, b, (uint32_t)min, (uint32_t *)v);
+      } else {
+        unpack128(packed, b, (uint32_t)min, block);
+        memcpy(v, block, (size_t)m * sizeof(int32_t));
+      }
+      continue;
+    }
+
+    // The NA code is the largest value in the block
+    unpack128(packed, b, 0, block);
+    uint32_t na = 0;
+    for (int j = 0; j < m; j++) na = block[j] > na ? block[j] : na;
+    for (int j = 0; j < m; j++) {
+      v[j] = block[j] == na ? INT_MIN : (int32_t)((uint32_t)min + block[j]);
+    }
+  }
+
+  return in == end ? 0 : BITPACK_ERROR;
+}
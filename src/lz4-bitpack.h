@@ -0,0 +1,34 @@
+#ifndef LZ4_BITPACK_H
+#define LZ4_BITPACK_H
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Frame-of-reference bit-packing of 32-bit integers, independent of R.
+//
+// Values are packed in blocks of BITPACK_BLOCK. Each block is
+//   - int32: reference value (the block minimum)
+//   - uint8: bit width 'b' of (value - reference)
+//   - uint8: flags. BITPACK_HAS_NA if the block contains NA
+//   - 16 * b bytes of packed values
+//
+// NA (INT_MIN) is stored as (max - min + 1). A final partial block is
+// padded with zeros.
+//
+// Within a block, value i is in lane (i % 4) and the four lanes are packed 
+// side by side ("vertical" layout) so that a 128-bit register packs or 
+// unpacks four values at a time.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BITPACK_BLOCK   128
+#define BITPACK_HEADER    6
+#define BITPACK_HAS_NA    1
+
+#define BITPACK_ERROR    -1
+
+size_t bitpack_bound(int n);
+size_t bitpack_encode(const int32_t *x, int n, char *dst);
+int    bitpack_decode(int32_t *x, int n, const char *src, size_t len);
+
+#endif
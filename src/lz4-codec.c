@@ -0,0 +1,152 @@
+
+#define R_NO_REMAP
+
+#include <R.h>
+#include <Rinternals.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "lz4.h"
+#include "lz4-serialize.h"
+#include "lz4-codec.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Free all state held by a codec
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void lz4_codec_free(lz4_codec_t *codec) {
+  if (codec == NULL) return;
+  if (codec->dict_stream != NULL) LZ4_freeStream(codec->dict_stream);
+  if (codec->stream_out  != NULL) LZ4_freeStream(codec->stream_out);
+  if (codec->db          != NULL) db_free(codec->db);
+  free(codec);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Finalizer for the external pointer
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void lz4_codec_finalizer(SEXP codec_) {
+  lz4_codec_free((lz4_codec_t *)R_ExternalPtrAddr(codec_));
+  R_ClearExternalPtr(codec_);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unpack a codec from an R object.  
+// Returns NULL if 'codec_' is NULL i.e. no codec was specified.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+lz4_codec_t *lz4_codec_get(SEXP codec_) {
+  if (Rf_isNull(codec_)) return NULL;
+  
+  if (TYPEOF(codec_) != EXTPTRSXP || !Rf_inherits(codec_, "lz4_codec")) {
+    Rf_error("'codec' must be an object created by 'lz4_codec()'");
+  }
+  
+  lz4_codec_t *codec = (lz4_codec_t *)R_ExternalPtrAddr(codec_);
+  if (codec == NULL) {
+    Rf_error("'codec' is no longer valid");
+  }
+  
+  return codec;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Prepare a freshly reset compression stream with the codec's dictionary.
+// Attaching refers to the pre-loaded dictionary state rather than 
+// re-hashing the dictionary as 'LZ4_loadDict()' would.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void lz4_codec_attach_dict(lz4_codec_t *codec, LZ4_stream_t *stream) {
+  if (codec->dict_stream != NULL) {
+    LZ4_attach_dictionary(stream, codec->dict_stream);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unpack a 'target_mbps' argument. Returns 0 for NULL i.e. a fixed 
+// acceleration
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+double lz4_target_mbps(SEXP target_mbps_) {
+  if (Rf_isNull(target_mbps_)) return 0;
+  
+  double target_mbps = Rf_asReal(target_mbps_);
+  if (!(target_mbps > 0)) {
+    Rf_error("'target_mbps' must be a positive number or NULL");
+  }
+  return target_mbps;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Create a codec
+//
+// @param acc_ acceleration. integer
+// @param dict_ raw vector or NULL
+// @param block_size_ target uncompressed block size for serialization
+// @param target_mbps_ target compression throughput for serialization, 
+//        or NULL for a fixed acceleration
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_codec_(SEXP acc_, SEXP dict_, SEXP block_size_, SEXP target_mbps_) {
+  
+  int acc        = Rf_asInteger(acc_);
+  int block_size = Rf_asInteger(block_size_);
+  double target_mbps = lz4_target_mbps(target_mbps_);
+  
+  if (acc == NA_INTEGER || acc < 1 || acc > 65535) {
+    Rf_error("'acc' must be in range [1, 65535]");
+  }
+  if (block_size == NA_INTEGER || block_size < MIN_BLOCK_SIZE || block_size > BUF_SIZE) {
+    Rf_error("'block_size' must be in range [%i, %i]", MIN_BLOCK_SIZE, BUF_SIZE);
+  }
+  if (!Rf_isNull(dict_) && TYPEOF(dict_) != RAWSXP) {
+    Rf_error("Dictionary must be raw() vector or NULL");
+  }
+  
+  lz4_codec_t *codec = calloc(1, sizeof(lz4_codec_t));
+  if (codec == NULL) {
+    Rf_error("Couldn't allocate codec");
+  }
+  
+  codec->acceleration = acc;
+  codec->block_size   = block_size;
+  codec->target_mbps  = target_mbps;
+  codec->acc_reached  = acc;
+  codec->dict_        = dict_;
+  codec->stream_out   = LZ4_createStream();
+  
+  if (TYPEOF(dict_) == RAWSXP && Rf_length(dict_) > 0) {
+    codec->dict        = (const char *)RAW(dict_);
+    codec->dict_size   = Rf_length(dict_);
+    codec->dict_stream = LZ4_createStream();
+    if (codec->dict_stream == NULL || 
+        LZ4_loadDict(codec->dict_stream, codec->dict, codec->dict_size) <= 0) {
+      lz4_codec_free(codec);
+      Rf_error("Error loading dictionary");
+    }
+  }
+  
+  if (codec->stream_out == NULL) {
+    lz4_codec_free(codec);
+    Rf_error("Couldn't allocate LZ4 stream");
+  }
+  
+  // Wrap in an external pointer first, so the finalizer frees everything 
+  // if the serialization context can't be allocated.
+  // The dictionary is kept alive by the 'prot' slot.
+  SEXP codec_ = PROTECT(R_MakeExternalPtr(codec, R_NilValue, dict_));
+  R_RegisterCFinalizerEx(codec_, lz4_codec_finalizer, TRUE);
+  Rf_setAttrib(codec_, R_ClassSymbol, Rf_mkString("lz4_codec"));
+  
+  codec->db = db_new();
+  if (codec->db == NULL) {
+    Rf_error("Couldn't allocate double buffer");
+  }
+  codec->db->owner = codec;
+  
+  UNPROTECT(1);
+  return codec_;
+}
@@ -0,0 +1,36 @@
+#ifndef LZ4_CODEC_H
+#define LZ4_CODEC_H
+
+#include <Rinternals.h>
+#include <stdbool.h>
+
+#include "lz4.h"
+#include "lz4-serialize.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A codec holds compression settings along with LZ4 state which has been
+// initialised once, so that repeated calls do not pay the setup cost.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct lz4_codec_st {
+  int acceleration;            // range [1, 65535]
+  int block_size;              // Target uncompressed block size for streams
+  double target_mbps;          // If > 0, adapt acceleration when serializing
+  int acc_reached;             // Acceleration adapted to by the last serialization
+  
+  SEXP dict_;                  // raw vector or R_NilValue. Kept alive by the external pointer
+  const char *dict;            // Dictionary data (NULL if no dictionary)
+  int dict_size;
+  LZ4_stream_t *dict_stream;   // Compression state with the dictionary loaded
+  
+  LZ4_stream_t *stream_out;    // Working state for block compression
+  
+  dbuf_t *db;                  // Serialization context owned by this codec
+  bool db_busy;                // Is 'db' currently in use?
+} lz4_codec_t;
+
+
+lz4_codec_t *lz4_codec_get(SEXP codec_);
+void lz4_codec_attach_dict(lz4_codec_t *codec, LZ4_stream_t *stream);
+double lz4_target_mbps(SEXP target_mbps_);
+
+#endif
@@ -4,24 +4,110 @@
 #include <R.h>
 #include <Rinternals.h>
 
+#include <stdbool.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 #include "lz4.h"
+#include "lz4-codec.h"
+#include "lz4-stats.h"
+#include "lz4-trace.h"
+#include "lz4-dispatch.h"
+#include "lz4-typed.h"
+#include "lz4-stream.h"
 
 #define MAGIC_LENGTH 8
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// Compress atomic vectors
-//
-// @param src_ buffer to be compressed. Raw bytes.
-// @param acc_ acceleration. integer
-// LZ4_compress_fast (const char* src, char* dst, int srcSize, int dstCapacity, int acceleration);
+// Compress a single buffer with the codec, dictionary or plain LZ4.
+// Returns the number of compressed bytes written to 'dst'.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int compress_with(const char *src, int srcSize, char *dst, int dstCapacity,
+                         int acc, SEXP dict_, lz4_codec_t *codec, lz4_stats_t *st) {
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  //Compression function returns an integer, which is non-zero, positive
+  //integer if successful (representing length), or a 0 or negative number
+  //in case of an error
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  bool timed = st != NULL || TRACE_ACTIVE(compress);
+  uint64_t start = timed ? lz4_stats_now() : 0;
+  int num_compressed_bytes;
+  if (codec != NULL) {
+    // Re-use the codec's initialised state
+    LZ4_resetStream_fast(codec->stream_out);
+    lz4_codec_attach_dict(codec, codec->stream_out);
+    num_compressed_bytes = lz4_kernels.compress_fast_continue(codec->stream_out, src, dst, srcSize, dstCapacity, acc);
+  } else if (TYPEOF(dict_) == RAWSXP) {
+    LZ4_stream_t stream;
+    LZ4_initStream(&stream, sizeof(stream));
+    LZ4_loadDict(&stream, (const char *)RAW(dict_), Rf_length(dict_));
+    num_compressed_bytes = lz4_kernels.compress_fast_continue(&stream, src, dst, srcSize, dstCapacity, acc);
+  } else {
+    num_compressed_bytes = lz4_kernels.compress_fast(src, dst, srcSize, dstCapacity, acc);
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Watch for compression failure
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (num_compressed_bytes <= 0) {
+    Rf_error("Compression error. Status: %i", num_compressed_bytes);
+  }
+  if (timed) {
+    uint64_t ns = lz4_stats_now() - start;
+    if (st != NULL) lz4_stats_block(st, ns, srcSize, num_compressed_bytes);
+    TRACE_BLOCK(compress, TRACE_COMPRESS, start, ns, srcSize, num_compressed_bytes);
+  }
+
+  return num_compressed_bytes;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress a single buffer of exactly 'dstCapacity' bytes
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP lz4_compress_(SEXP src_) {
+static void decompress_with(const char *src, int compressedSize, char *dst, int dstCapacity,
+                            const char *dict, int dict_size, lz4_stats_t *st) {
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // SEXP type will determine multiplier for data size
+  // Deompression function returns an integer, which is non-zero, positive
+  // integer if successful (representing length), or a 0 or negative number
+  // in case of an error
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  bool timed = st != NULL || TRACE_ACTIVE(decompress);
+  uint64_t start = timed ? lz4_stats_now() : 0;
+  int status;
+  if (dict != NULL) {
+    status = lz4_kernels.decompress_safe_usingDict(src, dst, compressedSize, dstCapacity, dict, dict_size);
+  } else {
+    status = lz4_kernels.decompress_safe(src, dst, compressedSize, dstCapacity);
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Watch for badness
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (status < 0 || status != dstCapacity) {
+    Rf_error("De-compression error. Status: %i", status);
+  }
+  if (timed) {
+    uint64_t ns = lz4_stats_now() - start;
+    if (st != NULL) lz4_stats_block(st, ns, status, compressedSize);
+    TRACE_BLOCK(decompress, TRACE_DECOMPRESS, start, ns, status, compressedSize);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress a raw vector into an 'LZ4C' buffer
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP compress_raw(SEXP src_, int acc, SEXP dict_, lz4_codec_t *codec, lz4_stats_t *st) {
+
   int srcSize   = Rf_length(src_);
-  void *src = (char *)RAW(src_);
+  const char *src = (const char *)RAW(src_);
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // calculate maximum possible size of compressed buffer in the worst case
@@ -38,21 +124,8 @@ SEXP lz4_compress_(SEXP src_) {
   SEXP dst_ = PROTECT(Rf_allocVector(RAWSXP, dstCapacity + MAGIC_LENGTH));
   char *dst = (char *)RAW(dst_);
 
-
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  //Compression function returns an integer, which is non-zero, positive
-  //integer if successful (representing length), or a 0 or negative number
-  //in case of an error
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  int num_compressed_bytes;
-  num_compressed_bytes = LZ4_compress_default(src, dst + MAGIC_LENGTH, srcSize, dstCapacity);
-
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Watch for compression failure
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (num_compressed_bytes <= 0) {
-    Rf_error("Compression error. Status: %i", num_compressed_bytes);
-  }
+  int num_compressed_bytes = compress_with(src, srcSize, dst + MAGIC_LENGTH, dstCapacity,
+                                           acc, dict_, codec, st);
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Add some magic bytes as the first 4 bytes
@@ -78,16 +151,132 @@ SEXP lz4_compress_(SEXP src_) {
 }
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress a vector with a native encoding into an 'LZ4T' typed frame.
+// The whole encoded body is compressed as one large block, or stored as-is
+// if it looks incompressible or LZ4 would make it bigger.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP compress_typed(SEXP src_, const typed_filter_t *filter, int acc, SEXP dict_, lz4_codec_t *codec, lz4_stats_t *st) {
+
+  size_t bound = typed_body_bound(src_, filter);
+  char *body = R_alloc(bound + 1, 1);
+  int body_size = (int)typed_body_encode(src_, filter, body);
+
+  int dstCapacity = LZ4_compressBound(body_size);
+  if (dstCapacity <= 0 || dstCapacity > INT_MAX - TYPED_HEADER_SIZE) {
+    Rf_error("Vector too large to compress: %i bytes", body_size);
+  }
+  SEXP dst_ = PROTECT(Rf_allocVector(RAWSXP, dstCapacity + TYPED_HEADER_SIZE));
+  char *dst = (char *)RAW(dst_);
+
+  uint8_t flags = 0;
+  int num_compressed_bytes = 0;
+  if (!lz4_incompressible((const uint8_t *)body, body_size)) {
+    num_compressed_bytes = compress_with(body, body_size, dst + TYPED_HEADER_SIZE, dstCapacity,
+                                         acc, dict_, codec, st);
+  }
+  if (num_compressed_bytes == 0 || num_compressed_bytes >= body_size) {
+    flags = TYPED_FLAG_STORED;
+    num_compressed_bytes = body_size;
+    memcpy(dst + TYPED_HEADER_SIZE, body, (size_t)body_size);
+  }
+
+  typed_header_t hdr = {
+    .type     = (uint8_t)TYPEOF(src_),
+    .filter   = (uint8_t)filter->filter,
+    .flags    = flags,
+    .n        = (int32_t)Rf_xlength(src_),
+    .raw_len  = body_size,
+    .comp_len = num_compressed_bytes
+  };
+  typed_header_write(dst, &hdr);
+
+  dst_ = PROTECT(Rf_lengthgets(dst_, num_compressed_bytes + TYPED_HEADER_SIZE));
+
+  UNPROTECT(2);
+  return dst_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress atomic vectors
+//
+// @param src_ buffer to be compressed. Raw bytes, or a character or numeric
+//        vector which is written as a typed frame
+// @param acc_ acceleration. integer
+// @param dict_ raw vector or NULL
+// @param codec_ codec created with 'lz4_codec()' or NULL.  If not NULL, 
+//        then 'acc_' and 'dict_' are ignored.
+// @param filter_ filter applied to typed frames before compression. 
+//        "auto", "none" or "xor"
+// LZ4_compress_fast (const char* src, char* dst, int srcSize, int dstCapacity, int acceleration);
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_compress_(SEXP src_, SEXP acc_, SEXP dict_, SEXP codec_, SEXP filter_) {
+
+  lz4_stats_t stats;
+  lz4_stats_t *st = lz4_stats_begin(&stats, STATS_OP_COMPRESS);
+
+  lz4_codec_t *codec = lz4_codec_get(codec_);
+  int acc = codec == NULL ? Rf_asInteger(acc_) : codec->acceleration;
+  
+  if (!Rf_isNull(dict_) && TYPEOF(dict_) != RAWSXP) {
+    Rf_error("Dictionary must be raw() vector or NULL");
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // SEXP type determines the frame format
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  SEXP dst_;
+  if (TYPEOF(src_) == RAWSXP) {
+    dst_ = PROTECT(compress_raw(src_, acc, dict_, codec, st));
+  } else if (typed_supported(src_)) {
+    typed_filter_t filter = typed_filter(src_, filter_);
+    dst_ = PROTECT(compress_typed(src_, &filter, acc, dict_, codec, st));
+  } else {
+    Rf_error("Don't know how to compress 'src' of type: %s", Rf_type2char(TYPEOF(src_)));
+  }
+
+  lz4_stats_end(st);
+  UNPROTECT(1);
+  return dst_;
+}
+
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Decompress a raw block
 //
 // @param src_ buffer to be decompressed. Raw bytes. The first 8 bytes of this
-//        must be a header with bytes[0:2] = 'LZ4'.  Byte[3] is the SEXPTYPE.
-//        bytes[4:7] represent a 32bit integer with the uncompressed length
+//        must be a header with bytes[0:2] = 'LZ4'.  Byte[3] is 'C' for raw 
+//        data, with bytes[4:7] a 32bit integer with the uncompressed length,
+//        or 'T' for a typed frame (see 'lz4-typed.h')
+//
+// @param dict_ raw vector or NULL. Must match the dictionary used for compression
+// @param codec_ codec created with 'lz4_codec()' or NULL
 //
 // int LZ4_decompress_safe (const char* src, char* dst, int compressedSize, int dstCapacity);
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP lz4_decompress_(SEXP src_) {
+SEXP lz4_decompress_(SEXP src_, SEXP dict_, SEXP codec_) {
+
+  lz4_stats_t stats;
+  lz4_stats_t *st = lz4_stats_begin(&stats, STATS_OP_DECOMPRESS);
+
+  lz4_codec_t *codec = lz4_codec_get(codec_);
+  
+  const char *dict = NULL;
+  int dict_size = 0;
+  if (codec != NULL) {
+    dict      = codec->dict;
+    dict_size = codec->dict_size;
+  } else if (TYPEOF(dict_) == RAWSXP) {
+    dict      = (const char *)RAW(dict_);
+    dict_size = Rf_length(dict_);
+  } else if (!Rf_isNull(dict_)) {
+    Rf_error("Dictionary must be raw() vector or NULL");
+  }
+
+  if (TYPEOF(src_) != RAWSXP || Rf_length(src_) < MAGIC_LENGTH) {
+    Rf_error("Buffer must be LZ4 data compressed with 'lz4lite'");
+  }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Some pointers into the buffer
@@ -95,6 +284,24 @@ SEXP lz4_decompress_(SEXP src_) {
   const char *src = (const char *)RAW(src_);
   const int *isrc = (const int *)src;
 
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Typed frame: decompress the body, then rebuild the vector from it
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (src[0] == 'L' && src[1] == 'Z' && src[2] == '4' && src[3] == 'T') {
+    typed_header_t hdr;
+    typed_header_read(src, Rf_xlength(src_), &hdr);
+    const char *body = src + TYPED_HEADER_SIZE;
+    if (!(hdr.flags & TYPED_FLAG_STORED)) {
+      char *tmp = R_alloc((size_t)hdr.raw_len + 1, 1);
+      decompress_with(body, hdr.comp_len, tmp, hdr.raw_len, dict, dict_size, st);
+      body = tmp;
+    }
+    SEXP dst_ = PROTECT(typed_body_decode(hdr.type, hdr.filter, hdr.n, body, (size_t)hdr.raw_len));
+    lz4_stats_end(st);
+    UNPROTECT(1);
+    return dst_;
+  }
+
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Check the magic bytes are correct i.e. there is a header with length info
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -108,29 +315,314 @@ SEXP lz4_decompress_(SEXP src_) {
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   int compressedSize = Rf_length(src_) - MAGIC_LENGTH;
   int dstCapacity = isrc[1];
+  if (dstCapacity < 0) {
+    Rf_error("De-compression error. Bad uncompressed length: %i", dstCapacity);
+  }
 
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Create a decompression buffer of the exact required size and do decompression
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   SEXP dst_ = PROTECT(Rf_allocVector(RAWSXP, dstCapacity));
-  void *dst = (void *)RAW(dst_);
+  char *dst = (char *)RAW(dst_);
 
+  decompress_with(src + MAGIC_LENGTH, compressedSize, dst, dstCapacity, dict, dict_size, st);
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Deompression function returns an integer, which is non-zero, positive
-  // integer if successful (representing length), or a 0 or negative number
-  // in case of an error
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  int status = LZ4_decompress_safe(src + MAGIC_LENGTH, dst, compressedSize, dstCapacity);
+  lz4_stats_end(st);
+  UNPROTECT(1);
+  return dst_;
+}
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Watch for badness
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (status <= 0) {
-    Rf_error("De-compression error. Status: %i", status);
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress a list of buffers, several at a time.
+//
+// All R objects are allocated up front on this thread. LZ4 decompression 
+// and the numeric/integer filters (which use no R API) then run in 
+// parallel. Character vectors are rebuilt afterwards as creating strings 
+// must happen on this thread.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  const char *src;     // Compressed body
+  int comp_len;
+  int raw_len;
+  char *body;          // Destination for the decompressed body
+  bool stored;         // Body is not compressed
+  int type;            // RAWSXP for 'LZ4C' buffers, else the typed frame's type
+  int filter;
+  int n;
+  void *dst;           // Numeric/integer result to decode the body into
+  const char *err;
+} frame_job_t;
+
+
+typedef struct {
+  frame_job_t *jobs;
+  R_xlen_t n;
+  const char *dict;
+  int dict_size;
+  int threads;
+#ifndef _WIN32
+  pthread_t thread;
+  bool running;
+#endif
+} frame_batch_t;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Parse the headers of all buffers in 'src_' into 'batch->jobs' and 
+// allocate the results in 'res_'.  Bodies which can't be decompressed
+// straight into a result get a raw vector in 'keep_', so they live as 
+// long as the results do.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void frame_batch_prepare(frame_batch_t *batch, SEXP src_, SEXP res_, SEXP keep_) {
+
+  for (R_xlen_t i = 0; i < batch->n; i++) {
+    SEXP buf_ = VECTOR_ELT(src_, i);
+    if (TYPEOF(buf_) != RAWSXP || Rf_length(buf_) < MAGIC_LENGTH) {
+      Rf_error("Buffer must be LZ4 data compressed with 'lz4lite'");
+    }
+    const char *src = (const char *)RAW(buf_);
+    frame_job_t *job = &batch->jobs[i];
+    memset(job, 0, sizeof(frame_job_t));
+
+    if (memcmp(src, "LZ4C", 4) == 0) {
+      memcpy(&job->raw_len, src + 4, sizeof(int32_t));
+      if (job->raw_len < 0) {
+        Rf_error("De-compression error. Bad uncompressed length: %i", job->raw_len);
+      }
+      job->type     = RAWSXP;
+      job->src      = src + MAGIC_LENGTH;
+      job->comp_len = Rf_length(buf_) - MAGIC_LENGTH;
+      SET_VECTOR_ELT(res_, i, Rf_allocVector(RAWSXP, job->raw_len));
+      job->body = (char *)RAW(VECTOR_ELT(res_, i));
+      continue;
+    }
+
+    typed_header_t hdr;
+    typed_header_read(src, Rf_xlength(buf_), &hdr);
+    job->type     = hdr.type;
+    job->filter   = hdr.filter;
+    job->n        = hdr.n;
+    job->src      = src + TYPED_HEADER_SIZE;
+    job->comp_len = hdr.comp_len;
+    job->raw_len  = hdr.raw_len;
+    job->stored   = hdr.flags & TYPED_FLAG_STORED;
+    job->body     = job->stored ? (char *)job->src : NULL;
+
+    if (hdr.type == REALSXP || hdr.type == INTSXP) {
+      SET_VECTOR_ELT(res_, i, Rf_allocVector(hdr.type, hdr.n));
+      job->dst = DATAPTR(VECTOR_ELT(res_, i));
+      // Unfiltered values are decompressed straight into the result
+      size_t size = hdr.type == REALSXP ? sizeof(double) : sizeof(int32_t);
+      if (!job->stored && hdr.filter == TYPED_FILTER_NONE && 
+          (size_t)hdr.raw_len == (size_t)hdr.n * size) {
+        job->body = job->dst;
+      }
+    } else if (hdr.type != STRSXP) {
+      Rf_error("Typed frame has unsupported type: %i", hdr.type);
+    }
+    if (job->body == NULL) {
+      SET_VECTOR_ELT(keep_, i, Rf_allocVector(RAWSXP, hdr.raw_len));
+      job->body = (char *)RAW(VECTOR_ELT(keep_, i));
+    }
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress and decode all jobs.  Uses no R API, so may run on any thread
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void frame_batch_run(frame_batch_t *batch) {
+  frame_job_t *jobs = batch->jobs;
+  const char *dict  = batch->dict;
+  int dict_size     = batch->dict_size;
+  R_xlen_t n        = batch->n;
+
+  int threads = batch->threads;
+  if (threads > n) threads = n < 1 ? 1 : (int)n;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+#endif
+  for (R_xlen_t i = 0; i < n; i++) {
+    frame_job_t *job = &jobs[i];
+    if (!job->stored) {
+      int status = dict != NULL ?
+        lz4_kernels.decompress_safe_usingDict(job->src, job->body, job->comp_len, job->raw_len, dict, dict_size) :
+        lz4_kernels.decompress_safe(job->src, job->body, job->comp_len, job->raw_len);
+      if (status != job->raw_len) {
+        job->err = "De-compression error";
+        continue;
+      }
+    }
+    if (job->dst != NULL && job->dst != job->body) {
+      job->err = typed_body_decode_into(job->type, job->filter, job->n, job->body, 
+                                        (size_t)job->raw_len, job->dst);
+    }
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Report errors and rebuild character vectors, on R's thread
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void frame_batch_finish(frame_batch_t *batch, SEXP res_) {
+  frame_job_t *jobs = batch->jobs;
+  for (R_xlen_t i = 0; i < batch->n; i++) {
+    if (jobs[i].err != NULL) {
+      Rf_error("%s (buffer %.0f)", jobs[i].err, (double)i + 1);
+    }
+    if (jobs[i].type == STRSXP) {
+      SET_VECTOR_ELT(res_, i, typed_body_decode(STRSXP, jobs[i].filter, jobs[i].n, 
+                                                jobs[i].body, (size_t)jobs[i].raw_len));
+    }
+  }
+}
+
+
+static void frame_batch_init(frame_batch_t *batch, SEXP src_, SEXP dict_, SEXP codec_, SEXP threads_) {
+  if (TYPEOF(src_) != VECSXP) {
+    Rf_error("'src' must be a list of raw vectors");
+  }
+  int threads = Rf_asInteger(threads_);
+  if (threads == NA_INTEGER || threads < 1) {
+    Rf_error("'threads' must be a positive integer");
   }
 
+  lz4_codec_t *codec = lz4_codec_get(codec_);
+  memset(batch, 0, sizeof(frame_batch_t));
+  if (codec != NULL) {
+    batch->dict      = codec->dict;
+    batch->dict_size = codec->dict_size;
+  } else if (TYPEOF(dict_) == RAWSXP) {
+    batch->dict      = (const char *)RAW(dict_);
+    batch->dict_size = Rf_length(dict_);
+  } else if (!Rf_isNull(dict_)) {
+    Rf_error("Dictionary must be raw() vector or NULL");
+  }
+  batch->n       = Rf_xlength(src_);
+  batch->threads = threads;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// @param src_ list of raw vectors, each as from 'lz4_compress()'
+// @param dict_ raw vector or NULL
+// @param codec_ codec or NULL. Overrides 'dict_'
+// @param threads_ maximum number of threads
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_decompress_list_(SEXP src_, SEXP dict_, SEXP codec_, SEXP threads_) {
+
+  frame_batch_t batch;
+  frame_batch_init(&batch, src_, dict_, codec_, threads_);
+  batch.jobs = (frame_job_t *)R_alloc((size_t)batch.n + 1, sizeof(frame_job_t));
+
+  SEXP res_  = PROTECT(Rf_allocVector(VECSXP, batch.n));
+  SEXP keep_ = PROTECT(Rf_allocVector(VECSXP, batch.n));
+  frame_batch_prepare(&batch, src_, res_, keep_);
+  frame_batch_run(&batch);
+  frame_batch_finish(&batch, res_);
+
+  UNPROTECT(2);
+  return res_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decode-ahead.
+//
+// 'lz4_decompress_list_start_()' prepares a batch as above and then 
+// decompresses it on a background thread, so R can carry on with other 
+// work.  'lz4_decompress_list_finish_()' waits for the thread and returns
+// the results.  The handle keeps the sources, results and dictionary 
+// alive while the thread runs.
+//
+// On Windows the batch is decompressed by 'start' before it returns.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#ifndef _WIN32
+static void *frame_batch_thread(void *arg) {
+  frame_batch_run((frame_batch_t *)arg);
+  return NULL;
+}
+#endif
+
+
+static void frame_batch_wait(frame_batch_t *batch) {
+#ifndef _WIN32
+  if (batch->running) {
+    pthread_join(batch->thread, NULL);
+    batch->running = false;
+  }
+#endif
+}
+
+
+static void frame_batch_finalizer(SEXP handle_) {
+  frame_batch_t *batch = (frame_batch_t *)R_ExternalPtrAddr(handle_);
+  if (batch != NULL) {
+    frame_batch_wait(batch);
+    free(batch->jobs);
+    free(batch);
+    R_ClearExternalPtr(handle_);
+  }
+}
+
+
+SEXP lz4_decompress_list_start_(SEXP src_, SEXP dict_, SEXP codec_, SEXP threads_) {
+
+  frame_batch_t init;
+  frame_batch_init(&init, src_, dict_, codec_, threads_);
+
+  SEXP prot_ = PROTECT(Rf_allocVector(VECSXP, 5));
+  SET_VECTOR_ELT(prot_, 0, src_);
+  SET_VECTOR_ELT(prot_, 1, Rf_allocVector(VECSXP, init.n)); // results
+  SET_VECTOR_ELT(prot_, 2, Rf_allocVector(VECSXP, init.n)); // bodies
+  SET_VECTOR_ELT(prot_, 3, dict_);
+  SET_VECTOR_ELT(prot_, 4, codec_);
+
+  frame_batch_t *batch = (frame_batch_t *)malloc(sizeof(frame_batch_t));
+  frame_job_t *jobs    = (frame_job_t *)malloc(((size_t)init.n + 1) * sizeof(frame_job_t));
+  if (batch == NULL || jobs == NULL) {
+    free(batch);
+    free(jobs);
+    Rf_error("Couldn't allocate decode-ahead batch");
+  }
+  *batch = init;
+  batch->jobs = jobs;
+
+  SEXP handle_ = PROTECT(R_MakeExternalPtr(batch, R_NilValue, prot_));
+  R_RegisterCFinalizerEx(handle_, frame_batch_finalizer, TRUE);
+
+  frame_batch_prepare(batch, src_, VECTOR_ELT(prot_, 1), VECTOR_ELT(prot_, 2));
+
+#ifndef _WIN32
+  batch->running = pthread_create(&batch->thread, NULL, frame_batch_thread, batch) == 0;
+  if (!batch->running) {
+    frame_batch_run(batch);
+  }
+#else
+  frame_batch_run(batch);
+#endif
+
+  UNPROTECT(2);
+  return handle_;
+}
+
+
+SEXP lz4_decompress_list_finish_(SEXP handle_) {
+  if (TYPEOF(handle_) != EXTPTRSXP) {
+    Rf_error("Not a decode-ahead handle");
+  }
+  frame_batch_t *batch = (frame_batch_t *)R_ExternalPtrAddr(handle_);
+  if (batch == NULL) {
+    Rf_error("Decode-ahead batch has already been finished");
+  }
+  frame_batch_wait(batch);
+
+  SEXP res_ = PROTECT(VECTOR_ELT(R_ExternalPtrProtected(handle_), 1));
+  frame_batch_finish(batch, res_);
+  frame_batch_finalizer(handle_);
   UNPROTECT(1);
-  return dst_;
+  return res_;
 }
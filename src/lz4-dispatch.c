@@ -0,0 +1,146 @@
+
+#ifndef LZ4LITE_STANDALONE
+#define R_NO_REMAP
+#include <R.h>
+#include <Rinternals.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4.h"
+#include "lz4-dispatch.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The baseline build of lz4.c.  This is the default, so the kernels are
+// always valid even if 'lz4_dispatch_init()' has not been called.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static const lz4_kernels_t lz4_kernels_baseline = {
+  .name                      = "baseline",
+  .compress_fast             = LZ4_compress_fast,
+  .compress_fast_continue    = LZ4_compress_fast_continue,
+  .decompress_safe           = LZ4_decompress_safe,
+  .decompress_safe_continue  = LZ4_decompress_safe_continue,
+  .decompress_safe_usingDict = LZ4_decompress_safe_usingDict
+};
+
+lz4_kernels_t lz4_kernels = {
+  .name                      = "baseline",
+  .compress_fast             = LZ4_compress_fast,
+  .compress_fast_continue    = LZ4_compress_fast_continue,
+  .decompress_safe           = LZ4_decompress_safe,
+  .decompress_safe_continue  = LZ4_decompress_safe_continue,
+  .decompress_safe_usingDict = LZ4_decompress_safe_usingDict
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// All variants
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+const char *lz4_dispatch_names[LZ4_DISPATCH_COUNT] = {"baseline", "avx2", "avx512"};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The kernels for a variant, or NULL if the variant is unknown or not 
+// supported by this CPU
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static const lz4_kernels_t *dispatch_find(const char *name) {
+  if (strcmp(name, "baseline") == 0) {
+    return &lz4_kernels_baseline;
+  }
+  
+#ifdef LZ4LITE_HAVE_DISPATCH
+  __builtin_cpu_init();
+  if (strcmp(name, "avx2") == 0 && 
+      __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+    return &lz4_kernels_avx2;
+  }
+  if (strcmp(name, "avx512") == 0 && 
+      __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && 
+      __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("bmi2")) {
+    return &lz4_kernels_avx512;
+  }
+#endif
+  
+  return NULL;
+}
+
+
+int lz4_dispatch_supported(const char *name) {
+  return dispatch_find(name) != NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Select a variant by name.  
+//
+// Not thread safe: nothing may be compressing or decompressing at the time.
+// Returns -1 if the variant is unknown, or not supported by this CPU
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int lz4_dispatch_select(const char *name) {
+  const lz4_kernels_t *kernels = dispatch_find(name);
+  if (kernels == NULL) {
+    return -1;
+  }
+  lz4_kernels = *kernels;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Select the variant named by 'LZ4LITE_ISA', if any.  
+//
+// The baseline stays in use otherwise: the wider builds showed no 
+// consistent gain, and were slower on some inputs.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void lz4_dispatch_init(void) {
+  const char *isa = getenv("LZ4LITE_ISA");
+  if (isa != NULL) {
+    lz4_dispatch_select(isa);
+  }
+}
+
+
+#ifndef LZ4LITE_STANDALONE
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Select the build of the LZ4 kernels, e.g. to compare their speed or to 
+// check that their output is interchangeable
+//
+// @param isa_ "baseline", "avx2" or "avx512". NULL to leave unchanged
+//
+// @return list of 
+//    - active: name of the kernels in use
+//    - supported: names of the kernels this CPU can run
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_kernels_(SEXP isa_) {
+  if (!Rf_isNull(isa_)) {
+    if (TYPEOF(isa_) != STRSXP || Rf_length(isa_) != 1) {
+      Rf_error("'isa' must be a single string");
+    }
+    const char *isa = CHAR(STRING_ELT(isa_, 0));
+    if (lz4_dispatch_select(isa) < 0) {
+      Rf_error("LZ4 kernels '%s' are unknown or not supported by this CPU", isa);
+    }
+  }
+  
+  int nsupported = 0;
+  for (int i = 0; i < LZ4_DISPATCH_COUNT; i++) {
+    nsupported += lz4_dispatch_supported(lz4_dispatch_names[i]);
+  }
+  
+  SEXP supported_ = PROTECT(Rf_allocVector(STRSXP, nsupported));
+  for (int i = 0, j = 0; i < LZ4_DISPATCH_COUNT; i++) {
+    if (lz4_dispatch_supported(lz4_dispatch_names[i])) {
+      SET_STRING_ELT(supported_, j++, Rf_mkChar(lz4_dispatch_names[i]));
+    }
+  }
+  
+  const char *names[] = {"active", "supported", ""};
+  SEXP res_ = PROTECT(Rf_mkNamed(VECSXP, names));
+  SET_VECTOR_ELT(res_, 0, Rf_mkString(lz4_kernels.name));
+  SET_VECTOR_ELT(res_, 1, supported_);
+  
+  UNPROTECT(2);
+  return res_;
+}
+#endif
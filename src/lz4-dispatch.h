@@ -0,0 +1,49 @@
+#ifndef LZ4_DISPATCH_H
+#define LZ4_DISPATCH_H
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Runtime CPU dispatch of the LZ4 compression/decompression kernels.
+//
+// 'lz4.c' is built once for the baseline ISA, and on x86-64 once more for
+// each of AVX2 and AVX-512 (see 'lz4-avx2.c' and 'lz4-avx512.c').  These 
+// are the same code compiled for a wider target, not hand-written kernels.
+// All hot calls go through 'lz4_kernels', which is the baseline unless
+// another variant is selected.
+//
+// Stream state (LZ4_stream_t etc) is identical across variants, so it may
+// be initialised with the baseline functions and then used with any kernel.
+//
+// The environment variable 'LZ4LITE_ISA' (baseline/avx2/avx512) selects a
+// variant at load time, and 'lz4_dispatch_select()' changes it afterwards.
+//
+// 'lz4-dispatch.c' also holds the R entry point for selecting a variant.
+// Define LZ4LITE_STANDALONE to build it without R (see 'microbench/').
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include "lz4.h"
+#include "lz4-isa.h"
+
+typedef struct {
+  const char *name;
+  int (*compress_fast)(const char *src, char *dst, int srcSize, int dstCapacity, int acceleration);
+  int (*compress_fast_continue)(LZ4_stream_t *stream, const char *src, char *dst, int srcSize, int dstCapacity, int acceleration);
+  int (*decompress_safe)(const char *src, char *dst, int compressedSize, int dstCapacity);
+  int (*decompress_safe_continue)(LZ4_streamDecode_t *stream, const char *src, char *dst, int srcSize, int dstCapacity);
+  int (*decompress_safe_usingDict)(const char *src, char *dst, int srcSize, int dstCapacity, const char *dict, int dictSize);
+} lz4_kernels_t;
+
+extern lz4_kernels_t lz4_kernels;
+
+#ifdef LZ4LITE_HAVE_DISPATCH
+extern const lz4_kernels_t lz4_kernels_avx2;
+extern const lz4_kernels_t lz4_kernels_avx512;
+#endif
+
+#define LZ4_DISPATCH_COUNT 3
+extern const char *lz4_dispatch_names[LZ4_DISPATCH_COUNT];
+
+void lz4_dispatch_init(void);
+int  lz4_dispatch_select(const char *name);
+int  lz4_dispatch_supported(const char *name);
+
+#endif
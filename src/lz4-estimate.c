@@ -0,0 +1,427 @@
+
+#define R_NO_REMAP
+
+#include <R.h>
+#include <Rinternals.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "lz4-stream.h"
+#include "lz4-serialize.h"
+#include "lz4-altrep.h"
+#include "lz4-stats.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Estimate compression ratio and speed from a sample of blocks.
+//
+// Raw vectors are sampled directly. Anything else is serialized, and a
+// fixed number of blocks of the serialized stream are kept by reservoir
+// sampling, so memory use does not depend on the size of the object.
+//
+// To bound the time taken as well, only part of the object is serialized.
+// Lists and data.frames are sampled by top-level element, and any atomic
+// vector larger than its share of EST_BUDGET times the sample size is cut
+// down to evenly spaced runs of elements.  The serialized size of the 
+// whole is scaled up from the parts.  Other objects, and lists within 
+// lists, are serialized in full, so take time linear in their size.
+//
+// Each sampled block is compressed and decompressed with the same block
+// coder as 'lz4_serialize()' (so run-length and stored blocks are chosen
+// in the same way) at each acceleration level.  Blocks are coded
+// independently, so the ratio is slightly pessimistic for data which
+// benefits from history across blocks.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define EST_BLOCK  (128 * 1024)  // Size of each sampled block
+#define EST_PASSES 3             // Timings are the fastest of this many passes
+#define EST_PIECES 16            // Top-level elements of a list to serialize
+#define EST_BUDGET 4             // Serialize about this many times 'sample' bytes
+
+typedef struct {
+  dbuf_t *enc;
+  dbuf_t *dec;
+
+  // Sampled blocks
+  const uint8_t **ptr;
+  int *len;
+  int nslots;
+  int nsampled;
+
+  // Reservoir sampling of a serialized stream
+  uint8_t *store;     // nslots * EST_BLOCK bytes
+  uint64_t nblocks;   // blocks started so far
+  int cur;            // slot for the current block. -1 if not sampled
+  int cur_len;        // bytes in the current block
+  uint64_t total;     // total bytes serialized
+  double estimate;    // estimated serialized size of the whole object
+  uint64_t rng;
+
+  // Arguments
+  SEXP x_;
+  SEXP acc_;
+  int typed;
+  double sample;
+} est_t;
+
+
+static uint64_t est_rand(est_t *est) {
+  uint64_t x = est->rng;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  est->rng = x;
+  return x;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Start a new block of the serialized stream.
+// Block 't' replaces a random slot with probability nslots/(t + 1)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void est_next_block(est_t *est) {
+  uint64_t t = est->nblocks++;
+  if (t < (uint64_t)est->nslots) {
+    est->cur = (int)t;
+    est->nsampled++;
+  } else {
+    uint64_t j = est_rand(est) % (t + 1);
+    est->cur = j < (uint64_t)est->nslots ? (int)j : -1;
+  }
+  if (est->cur >= 0) {
+    est->len[est->cur] = 0;
+  }
+  est->cur_len = 0;
+}
+
+
+static void est_write_byte(R_outpstream_t stream, int c) {
+  Rf_error("est_write_byte(): This function is never called for binary serialization");
+}
+
+
+static void est_write_bytes(R_outpstream_t stream, void *src, int length) {
+  est_t *est = (est_t *)stream->data;
+  const uint8_t *p = (const uint8_t *)src;
+  est->total += (uint64_t)length;
+
+  while (length > 0) {
+    if (est->cur_len == EST_BLOCK) {
+      est_next_block(est);
+    }
+    int n = EST_BLOCK - est->cur_len;
+    if (n > length) n = length;
+    if (est->cur >= 0) {
+      memcpy(est->store + (size_t)est->cur * EST_BLOCK + est->cur_len, p, (size_t)n);
+      est->len[est->cur] += n;
+    }
+    est->cur_len += n;
+    p      += n;
+    length -= n;
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Raw vectors: evenly spaced blocks
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void est_sample_raw(est_t *est) {
+  R_xlen_t n = Rf_xlength(est->x_);
+  const uint8_t *src = RAW(est->x_);
+  est->total = (uint64_t)n;
+
+  R_xlen_t nblocks = (n + EST_BLOCK - 1) / EST_BLOCK;
+  int k = nblocks < est->nslots ? (int)nblocks : est->nslots;
+  for (int i = 0; i < k; i++) {
+    R_xlen_t b = (R_xlen_t)((double)i * (double)nblocks / k);
+    R_xlen_t offset = b * EST_BLOCK;
+    est->ptr[i] = src + offset;
+    est->len[i] = (int)(n - offset < EST_BLOCK ? n - offset : EST_BLOCK);
+  }
+  est->nsampled = k;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// An atomic vector cut down to about 'budget' bytes, as evenly spaced runs
+// of elements filling EST_BLOCK bytes each.  Attributes are dropped.
+// Sets 'scale' to the ratio of the original length to the result's.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP est_slice(SEXP x_, double budget, double *scale) {
+  *scale = 1;
+  
+  size_t size;
+  switch (TYPEOF(x_)) {
+  case LGLSXP : size = sizeof(int);       break;
+  case INTSXP : size = sizeof(int);       break;
+  case REALSXP: size = sizeof(double);    break;
+  case CPLXSXP: size = sizeof(Rcomplex);  break;
+  case RAWSXP : size = 1;                 break;
+  case STRSXP : size = 8;                 break; // a CHARSXP's header alone
+  default: return x_;
+  }
+  
+  R_xlen_t n = Rf_xlength(x_);
+  if ((double)n * size <= budget) {
+    return x_;
+  }
+  
+  R_xlen_t run   = (R_xlen_t)(EST_BLOCK / size);
+  R_xlen_t nruns = (R_xlen_t)(budget / EST_BLOCK) + 1;
+  R_xlen_t step  = n / nruns;
+  if (step < run) {
+    return x_;
+  }
+  
+  SEXP res_ = PROTECT(Rf_allocVector(TYPEOF(x_), nruns * run));
+  for (R_xlen_t r = 0; r < nruns; r++) {
+    R_xlen_t from = r * step, to = r * run;
+    switch (TYPEOF(x_)) {
+    case LGLSXP : LOGICAL_GET_REGION(x_, from, run, LOGICAL(res_) + to); break;
+    case INTSXP : INTEGER_GET_REGION(x_, from, run, INTEGER(res_) + to); break;
+    case REALSXP: REAL_GET_REGION   (x_, from, run, REAL(res_)    + to); break;
+    case CPLXSXP: COMPLEX_GET_REGION(x_, from, run, COMPLEX(res_) + to); break;
+    case RAWSXP : RAW_GET_REGION    (x_, from, run, RAW(res_)     + to); break;
+    default:
+      for (R_xlen_t i = 0; i < run; i++) {
+        SET_STRING_ELT(res_, to + i, STRING_ELT(x_, from + i));
+      }
+    }
+  }
+  
+  *scale = (double)n / (double)(nruns * run);
+  UNPROTECT(1);
+  return res_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Serialize 'x_' into the sample. Returns the number of bytes written
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static double est_serialize(est_t *est, SEXP x_) {
+  struct R_outpstream_st output_stream;
+  R_InitOutPStream(&output_stream, (R_pstream_data_t)est, R_pstream_binary_format, 3,
+                   est_write_byte, est_write_bytes, NULL, R_NilValue);
+  
+  uint64_t before = est->total;
+  x_ = PROTECT(est->typed ? lz4_typed_wrap(x_) : x_);
+  R_Serialize(x_, &output_stream);
+  UNPROTECT(1);
+  return (double)(est->total - before);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Size of the header R writes at the start of every serialization, 
+// from serializing NULL (which is then a single 4 byte item)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void est_count_bytes(R_outpstream_t stream, void *src, int length) {
+  *(double *)stream->data += length;
+}
+
+static double est_header_size(void) {
+  double size = 0;
+  struct R_outpstream_st output_stream;
+  R_InitOutPStream(&output_stream, (R_pstream_data_t)&size, R_pstream_binary_format, 3,
+                   est_write_byte, est_count_bytes, NULL, R_NilValue);
+  R_Serialize(R_NilValue, &output_stream);
+  return size - 4;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Serialize part of the object into the sample, and estimate the 
+// serialized size of the whole.
+//
+// The elements of a list are taken in EST_PIECES evenly spaced runs of 
+// consecutive elements, so that similar neighbouring elements still share
+// history as they would in the full serialization.  Each run stops once 
+// it has its share of the budget.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void est_sample_serialized(est_t *est) {
+  est->store   = (uint8_t *)R_alloc((size_t)est->nslots, EST_BLOCK);
+  est->cur_len = EST_BLOCK; // First write starts a block
+  
+  SEXP x_ = est->x_;
+  double budget = est->sample * EST_BUDGET;
+  double header = est_header_size();
+  double scale;
+  
+  if (TYPEOF(x_) != VECSXP || Rf_xlength(x_) == 0) {
+    SEXP piece_ = PROTECT(est_slice(x_, budget, &scale));
+    est->estimate = header + (est_serialize(est, piece_) - header) * scale;
+    UNPROTECT(1);
+  } else {
+    R_xlen_t n = Rf_xlength(x_);
+    int k = n < EST_PIECES ? (int)n : EST_PIECES;
+    double run_budget = budget / k;
+    double bytes = 0;
+    R_xlen_t visited = 0;
+    
+    for (int r = 0; r < k; r++) {
+      R_xlen_t from = (R_xlen_t)((double)r       * (double)n / k);
+      R_xlen_t to   = (R_xlen_t)((double)(r + 1) * (double)n / k);
+      double spent = 0;
+      for (R_xlen_t i = from; i < to && spent < run_budget; i++) {
+        SEXP piece_ = PROTECT(est_slice(VECTOR_ELT(x_, i), run_budget, &scale));
+        double len = est_serialize(est, piece_);
+        UNPROTECT(1);
+        spent += len;
+        bytes += (len - header) * scale;
+        visited++;
+      }
+    }
+    
+    est->estimate = header + bytes * (double)n / (double)visited;
+  }
+  
+  for (int i = 0; i < est->nsampled; i++) {
+    est->ptr[i] = est->store + (size_t)i * EST_BLOCK;
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Code all sampled blocks at acceleration 'acc'. Adds the compressed size
+// and the times taken to the given totals
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void est_pass(est_t *est, int acc, double *comp, double *ns_comp, double *ns_decomp) {
+  dbuf_t *enc = est->enc;
+  dbuf_t *dec = est->dec;
+
+  for (int i = 0; i < est->nsampled; i++) {
+    if (db_reset(enc, MODE_SERIALIZE | MODE_RAW) < 0 ||
+        db_reset(dec, MODE_UNSERIALIZE | MODE_RAW) < 0) {
+      Rf_error("Couldn't reset LZ4 stream");
+    }
+    enc->acceleration = acc;
+    memcpy(enc->buf[0], est->ptr[i], (size_t)est->len[i]);
+    enc->pos = (uint32_t)est->len[i];
+
+    uint64_t start = lz4_stats_now();
+    int comp_len = db_compress_block(enc);
+    uint64_t end = lz4_stats_now();
+    if (comp_len < 0) Rf_error("%s", enc->errmsg);
+    *comp    += comp_len;
+    *ns_comp += (double)(end - start);
+
+    memcpy(dec->comp, db_block_data(enc), (size_t)comp_len);
+    dec->block_len  = enc->pos;
+    dec->block_type = enc->block_type;
+
+    start = lz4_stats_now();
+    int res = db_decompress_block(dec, comp_len, dec->buf[0], BUF_SIZE);
+    end = lz4_stats_now();
+    if (res < 0) Rf_error("%s", dec->errmsg);
+    *ns_decomp += (double)(end - start);
+  }
+}
+
+
+static SEXP lz4_estimate_body(void *data) {
+  est_t *est = (est_t *)data;
+
+  if (TYPEOF(est->x_) == RAWSXP) {
+    est_sample_raw(est);
+  } else {
+    est_sample_serialized(est);
+  }
+
+  double sampled = 0;
+  for (int i = 0; i < est->nsampled; i++) {
+    sampled += est->len[i];
+  }
+
+  int nacc = Rf_length(est->acc_);
+  SEXP comp_      = PROTECT(Rf_allocVector(REALSXP, nacc));
+  SEXP ns_comp_   = PROTECT(Rf_allocVector(REALSXP, nacc));
+  SEXP ns_decomp_ = PROTECT(Rf_allocVector(REALSXP, nacc));
+
+  for (int a = 0; a < nacc; a++) {
+    int acc = INTEGER(est->acc_)[a];
+    double comp = 0, best_comp = 0, best_decomp = 0;
+    for (int pass = 0; pass < EST_PASSES; pass++) {
+      double ns_comp = 0, ns_decomp = 0;
+      comp = 0;
+      est_pass(est, acc, &comp, &ns_comp, &ns_decomp);
+      if (pass == 0 || ns_comp   < best_comp  ) best_comp   = ns_comp;
+      if (pass == 0 || ns_decomp < best_decomp) best_decomp = ns_decomp;
+    }
+    REAL(comp_)[a]      = comp;
+    REAL(ns_comp_)[a]   = best_comp;
+    REAL(ns_decomp_)[a] = best_decomp;
+  }
+
+  SEXP res_ = PROTECT(Rf_allocVector(VECSXP, 5));
+  SET_VECTOR_ELT(res_, 0, Rf_ScalarReal(TYPEOF(est->x_) == RAWSXP ? (double)est->total : est->estimate));
+  SET_VECTOR_ELT(res_, 1, Rf_ScalarReal(sampled));
+  SET_VECTOR_ELT(res_, 2, comp_);
+  SET_VECTOR_ELT(res_, 3, ns_comp_);
+  SET_VECTOR_ELT(res_, 4, ns_decomp_);
+
+  UNPROTECT(4);
+  return res_;
+}
+
+
+static void lz4_estimate_cleanup(void *data, Rboolean jump) {
+  est_t *est = (est_t *)data;
+  db_release(est->enc, jump);
+  db_release(est->dec, jump);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Estimate compression for 'x_'
+//
+// @param x_ any R object. Raw vectors are sampled as-is, anything else
+//        as it would be serialized
+// @param acc_ integer vector of acceleration levels
+// @param sample_ number of bytes to sample
+// @param typed_ logical. Sample the serialization with 'typed = TRUE'
+//
+// @return list of
+//    - bytes: total size of 'x_', or the estimated size of its serialization
+//    - sampled: number of bytes sampled
+//    - comp: numeric vector. Compressed size of the sample at each 'acc'
+//    - ns_compress: numeric vector. Time to compress the sample
+//    - ns_decompress: numeric vector. Time to decompress the sample
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_estimate_(SEXP x_, SEXP acc_, SEXP sample_, SEXP typed_) {
+
+  if (TYPEOF(acc_) != INTSXP || Rf_length(acc_) == 0) {
+    Rf_error("'acc' must be an integer vector");
+  }
+  for (int a = 0; a < Rf_length(acc_); a++) {
+    int acc = INTEGER(acc_)[a];
+    if (acc == NA_INTEGER || acc < 1 || acc > 65535) {
+      Rf_error("'acc' must be in range [1, 65535]");
+    }
+  }
+
+  double sample = Rf_asReal(sample_);
+  if (!(sample >= 1 && sample <= 1e9)) {
+    Rf_error("'sample' must be in range [1, 1e9] bytes");
+  }
+  int nslots = (int)((sample + EST_BLOCK - 1) / EST_BLOCK);
+
+  est_t est = {
+    .ptr    = (const uint8_t **)R_alloc((size_t)nslots, sizeof(uint8_t *)),
+    .len    = (int *)R_alloc((size_t)nslots, sizeof(int)),
+    .nslots = nslots,
+    .cur    = -1,
+    .rng    = 88172645463325252ULL,
+    .x_     = x_,
+    .acc_   = acc_,
+    .typed  = Rf_asLogical(typed_) == TRUE,
+    .sample = sample
+  };
+
+  est.enc = db_acquire(MODE_SERIALIZE, NULL);
+  est.dec = db_acquire(MODE_UNSERIALIZE, NULL);
+
+  SEXP cont_ = PROTECT(R_MakeUnwindCont());
+  SEXP res_  = R_UnwindProtect(lz4_estimate_body, &est, lz4_estimate_cleanup, &est, cont_);
+  UNPROTECT(1);
+  return res_;
+}
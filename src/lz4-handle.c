@@ -0,0 +1,371 @@
+
+#define R_NO_REMAP
+
+#include <R.h>
+#include <Rinternals.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "lz4.h"
+#include "lz4-serialize.h"
+#include "lz4-codec.h"
+#include "lz4-altrep.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Writer and reader handles for LZ4T streams of raw bytes.
+//
+// A handle owns its own context for the life of the stream, so compression
+// history carries across calls exactly as it does between the blocks of
+// one 'lz4_serialize()'.  Memory use is bounded by the context (two blocks
+// plus the compressed buffer) however long the stream is.
+//
+// The external pointer's 'prot' holds everything the stream refers to:
+// the destination/source (connection or raw vector), the dictionary and
+// the codec.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Release everything held by a handle's context
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void handle_free(dbuf_t *db) {
+  if (db == NULL) return;
+  if (db->file != NULL) fclose(db->file);
+  if (db->mode & MODE_SERIALIZE && db->mode & MODE_RAW) free(db->raw);
+  db->raw = NULL;
+  db_free(db);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Finalizer. A writer which was never closed loses its final partial
+// block, as there is no safe way to write to a connection during GC
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void handle_finalizer(SEXP handle_) {
+  handle_free((dbuf_t *)R_ExternalPtrAddr(handle_));
+  R_ClearExternalPtr(handle_);
+}
+
+
+static dbuf_t *handle_get(SEXP handle_, int mode) {
+  if (TYPEOF(handle_) != EXTPTRSXP) {
+    Rf_error("Not an lz4 stream handle");
+  }
+  dbuf_t *db = (dbuf_t *)R_ExternalPtrAddr(handle_);
+  if (db == NULL) {
+    Rf_error("Stream has been closed");
+  }
+  if (!(db->mode & mode)) {
+    Rf_error("Stream was not opened for %s", mode & MODE_SERIALIZE ? "writing" : "reading");
+  }
+  return db;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Create a context for a handle and wrap it in an external pointer.
+// Settings come from the codec (if given) or the individual arguments
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP handle_new(int mode, SEXP io_, SEXP acc_, SEXP dict_, SEXP codec_, const char *cls) {
+
+  lz4_codec_t *codec = lz4_codec_get(codec_);
+  if (codec != NULL) {
+    dict_ = codec->dict_;
+  } else if (!Rf_isNull(dict_) && TYPEOF(dict_) != RAWSXP) {
+    Rf_error("Dictionary must be raw() vector or NULL");
+  }
+
+  bool writing = mode & MODE_SERIALIZE;
+  int acc = codec != NULL ? codec->acceleration : writing ? Rf_asInteger(acc_) : 1;
+  if (acc == NA_INTEGER || acc < 1 || acc > 65535) {
+    Rf_error("'acc' must be in range [1, 65535]");
+  }
+
+  SEXP prot_ = PROTECT(Rf_allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(prot_, 0, io_);
+  SET_VECTOR_ELT(prot_, 1, dict_);
+  SET_VECTOR_ELT(prot_, 2, codec_);
+
+  dbuf_t *db = db_new();
+  if (db == NULL || db_reset(db, mode) < 0) {
+    if (db != NULL) db_free(db);
+    Rf_error("Couldn't allocate double buffer");
+  }
+
+  SEXP handle_ = PROTECT(R_MakeExternalPtr(db, R_NilValue, prot_));
+  R_RegisterCFinalizerEx(handle_, handle_finalizer, TRUE);
+  Rf_setAttrib(handle_, R_ClassSymbol, Rf_mkString(cls));
+
+  db->acceleration = acc;
+  if (codec != NULL) {
+    db->block_size  = codec->block_size;
+    db->target_mbps = codec->target_mbps;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Destination/source
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (Rf_inherits(io_, "connection")) {
+    db_use_connection(db, io_);
+  } else if (TYPEOF(io_) == STRSXP) {
+    db->mode |= MODE_FILE;
+    const char *filename = CHAR(STRING_ELT(io_, 0));
+    db->file = fopen(filename, writing ? "wb" : "rb");
+    if (db->file == NULL) {
+      Rf_error("Couldn't open file for %s: '%s'", writing ? "output" : "input", filename);
+    }
+  } else if (writing && Rf_isNull(io_)) {
+    db->mode |= MODE_RAW;
+    if (db_raw_begin(db) < 0) Rf_error("%s", db->errmsg);
+  } else if (!writing && TYPEOF(io_) == RAWSXP) {
+    db->mode |= MODE_RAW;
+    db->raw          = RAW(io_);
+    db->raw_capacity = (int)Rf_length(io_);
+  } else {
+    Rf_error("Don't know how to deal with '%s' of type: [%i] %s", writing ? "dst" : "src",
+             TYPEOF(io_), Rf_type2char(TYPEOF(io_)));
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Dictionary
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (writing && codec != NULL) {
+    lz4_codec_attach_dict(codec, db->stream_out);
+  } else if (TYPEOF(dict_) == RAWSXP && Rf_length(dict_) > 0) {
+    int res = writing ?
+      LZ4_loadDict(db->stream_out, (const char *)RAW(dict_), (int)Rf_length(dict_)) :
+      LZ4_setStreamDecode(db->stream_in, (const char *)RAW(dict_), (int)Rf_length(dict_));
+    if (res <= 0) {
+      Rf_error("Error loading dictionary");
+    }
+  }
+
+  if (writing && db->mode & (MODE_FILE | MODE_CALLBACK) && db_write_magic(db) < 0) {
+    Rf_error("%s", db->errmsg);
+  }
+
+  UNPROTECT(2);
+  return handle_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Create a writer
+//
+// @param dst_ filename, connection or NULL for a raw vector returned on close
+// @param acc_ acceleration
+// @param dict_ raw vector or NULL
+// @param codec_ codec or NULL. Overrides 'acc_' and 'dict_'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_writer_(SEXP dst_, SEXP acc_, SEXP dict_, SEXP codec_) {
+  return handle_new(MODE_SERIALIZE, dst_, acc_, dict_, codec_, "lz4_writer_handle");
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Append a raw vector to the stream. Full blocks are written immediately
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_writer_write_(SEXP handle_, SEXP x_) {
+  dbuf_t *db = handle_get(handle_, MODE_SERIALIZE);
+  if (TYPEOF(x_) != RAWSXP) {
+    Rf_error("Only raw vectors can be written");
+  }
+  if (db_write_all(db, RAW(x_), (size_t)Rf_xlength(x_)) < 0) {
+    Rf_error("%s", db->errmsg);
+  }
+  return R_NilValue;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// R serialization callbacks for objects within a stream
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void handle_write_byte(R_outpstream_t stream, int c) {
+  Rf_error("'handle_write_byte()' is never called");
+}
+
+
+static void handle_write_bytes(R_outpstream_t stream, void *src, int length) {
+  dbuf_t *db = (dbuf_t *)stream->data;
+  if (db_write_all(db, src, (size_t)length) < 0) {
+    Rf_error("%s", db->errmsg);
+  }
+}
+
+
+static int handle_read_byte(R_inpstream_t stream) {
+  Rf_error("'handle_read_byte()' is never called");
+  return 0;
+}
+
+
+static void handle_read_bytes(R_inpstream_t stream, void *dst, int length) {
+  dbuf_t *db = (dbuf_t *)stream->data;
+  if (db_read(db, dst, length) < 0) {
+    Rf_error("%s", db->errmsg);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Append an R object to the stream. 
+// Objects are not framed: each is R's own serialization, which 
+// 'R_Unserialize()' reads to exactly its last byte.  Blocks are not 
+// aligned to objects, so history from earlier objects is used for later
+// ones, and many small similar objects compress like one large one.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_writer_serialize_(SEXP handle_, SEXP x_, SEXP typed_) {
+  dbuf_t *db = handle_get(handle_, MODE_SERIALIZE);
+
+  struct R_outpstream_st output_stream;
+  R_InitOutPStream(
+    &output_stream,
+    (R_pstream_data_t) db,
+    R_pstream_binary_format,
+    3,
+    handle_write_byte,
+    handle_write_bytes,
+    NULL,
+    R_NilValue
+  );
+
+  SEXP obj_ = Rf_asLogical(typed_) == TRUE ? lz4_typed_wrap(x_) : x_;
+  PROTECT(obj_);
+  R_Serialize(obj_, &output_stream);
+  UNPROTECT(1);
+  return R_NilValue;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write out any partial block, so that everything written so far can be
+// read from the destination.  History still carries over to the next block
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_writer_flush_(SEXP handle_) {
+  dbuf_t *db = handle_get(handle_, MODE_SERIALIZE);
+  if (db->pos > 0) {
+    if (db_write_block(db) < 0) Rf_error("%s", db->errmsg);
+    db->idx = 1 - db->idx;
+    db->pos = 0;
+  }
+  if (db->file != NULL && fflush(db->file) != 0) {
+    Rf_error("Error writing to file");
+  }
+  return R_NilValue;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Flush and close a writer.
+// Returns the stream as a raw vector if writing to memory, otherwise NULL
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_writer_close_(SEXP handle_) {
+  dbuf_t *db = handle_get(handle_, MODE_SERIALIZE);
+
+  lz4_writer_flush_(handle_);
+
+  SEXP res_ = R_NilValue;
+  if (db->mode & MODE_RAW) {
+    res_ = PROTECT(Rf_allocVector(RAWSXP, db->raw_pos));
+    memcpy(RAW(res_), db->raw, db->raw_pos);
+    UNPROTECT(1);
+  }
+
+  int status = db->file != NULL ? fclose(db->file) : 0;
+  db->file = NULL;
+  handle_free(db);
+  R_ClearExternalPtr(handle_);
+
+  if (status != 0) {
+    Rf_error("Error writing to file");
+  }
+  return res_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Create a reader
+//
+// @param src_ filename, connection or raw vector
+// @param dict_ raw vector or NULL
+// @param codec_ codec or NULL. Overrides 'dict_'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_reader_(SEXP src_, SEXP dict_, SEXP codec_) {
+  return handle_new(MODE_UNSERIALIZE, src_, R_NilValue, dict_, codec_, "lz4_reader_handle");
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read up to 'n_' bytes. Fewer are returned only at the end of the stream
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_reader_read_(SEXP handle_, SEXP n_) {
+  dbuf_t *db = handle_get(handle_, MODE_UNSERIALIZE);
+
+  double n = Rf_asReal(n_);
+  if (!(n >= 0 && n <= INT_MAX)) {
+    Rf_error("'n' must be in range [0, %i]", INT_MAX);
+  }
+
+  SEXP res_ = PROTECT(Rf_allocVector(RAWSXP, (R_xlen_t)n));
+  int nread = db_read_some(db, RAW(res_), (int)n);
+  if (nread < 0) {
+    Rf_error("%s", db->errmsg);
+  }
+  if (nread < n) {
+    res_ = Rf_lengthgets(res_, nread);
+  }
+
+  UNPROTECT(1);
+  return res_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read the next R object from the stream
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_reader_unserialize_(SEXP handle_) {
+  dbuf_t *db = handle_get(handle_, MODE_UNSERIALIZE);
+
+  int status = db_at_end(db);
+  if (status < 0) Rf_error("%s", db->errmsg);
+  if (status == 1) Rf_error("No more objects in stream");
+
+  struct R_inpstream_st input_stream;
+  R_InitInPStream(
+    &input_stream,
+    (R_pstream_data_t) db,
+    R_pstream_any_format,
+    handle_read_byte,
+    handle_read_bytes,
+    NULL,
+    NULL
+  );
+
+  return R_Unserialize(&input_stream);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Has all data been read?
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_reader_at_end_(SEXP handle_) {
+  dbuf_t *db = handle_get(handle_, MODE_UNSERIALIZE);
+  int status = db_at_end(db);
+  if (status < 0) Rf_error("%s", db->errmsg);
+  return Rf_ScalarLogical(status);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Close a reader. Any unread data is discarded
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_reader_close_(SEXP handle_) {
+  dbuf_t *db = handle_get(handle_, MODE_UNSERIALIZE);
+  handle_free(db);
+  R_ClearExternalPtr(handle_);
+  return R_NilValue;
+}
@@ -0,0 +1,28 @@
+#ifndef LZ4_ISA_H
+#define LZ4_ISA_H
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Are ISA-specific builds of lz4.c available?
+//
+// Variants are only built for x86-64 with GCC/clang.  Windows is excluded as
+// the stack is not aligned for spilling AVX registers there.
+//
+// Kept separate from 'lz4-dispatch.h' as it must be checked before 'lz4.h'
+// is included by the variant builds.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && \
+    !defined(_WIN32) && !defined(LZ4LITE_NO_DISPATCH)
+#define LZ4LITE_HAVE_DISPATCH 1
+#endif
+
+// Apply a compiler target to all following function definitions
+#define LZ4_PRAGMA(x) _Pragma(#x)
+#if defined(__clang__)
+#define LZ4_TARGET_PUSH(isa) LZ4_PRAGMA(clang attribute push (__attribute__((target(isa))), apply_to = function))
+#define LZ4_TARGET_POP       LZ4_PRAGMA(clang attribute pop)
+#else
+#define LZ4_TARGET_PUSH(isa) LZ4_PRAGMA(GCC push_options) LZ4_PRAGMA(GCC target(isa))
+#define LZ4_TARGET_POP       LZ4_PRAGMA(GCC pop_options)
+#endif
+
+#endif
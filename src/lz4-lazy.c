@@ -0,0 +1,579 @@
+
+#define R_NO_REMAP
+
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Altrep.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4-lazy.h"
+
+// lz4-compress.c
+SEXP lz4_decompress_(SEXP src_, SEXP dict_, SEXP codec_);
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Lazy vectors.
+//
+// A numeric, integer, logical or character vector stored as a sequence of
+// blocks, each a typed frame from 'lz4_compress()' (logical vectors are
+// stored as integer frames).  Blocks are held in memory as raw vectors, 
+// or read from a file, and are decoded only when an element or region 
+// within them is asked for.  The most recently used decoded blocks are 
+// kept in a small cache.
+//
+// If R asks for a pointer to the whole vector, every block is decoded
+// into one ordinary vector which is used from then on.
+//
+// data1: external pointer to the 'lazy_t', protecting list(cache, blocks)
+// data2: the whole vector once decoded, else NULL
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  int type;              // REALSXP, INTSXP, LGLSXP or STRSXP
+  R_xlen_t n;
+  int nblocks;
+  R_xlen_t *starts;      // Index of the first element of each block, then 'n'
+
+  char *path;            // File holding the blocks, or NULL if in memory
+  double *offsets;       // Position of each block in the file
+  int *lengths;          // Compressed length of each block
+
+  int ncache;            // Number of decoded blocks to keep
+  int *cache_block;      // Block held in each cache slot, or -1
+  uint64_t *cache_used;  // When each slot was last used
+  uint64_t clock;
+} lazy_t;
+
+
+static R_altrep_class_t lazy_real_class;
+static R_altrep_class_t lazy_integer_class;
+static R_altrep_class_t lazy_logical_class;
+static R_altrep_class_t lazy_string_class;
+
+
+static void lazy_free(lazy_t *lz) {
+  if (lz == NULL) return;
+  free(lz->starts);
+  free(lz->path);
+  free(lz->offsets);
+  free(lz->lengths);
+  free(lz->cache_block);
+  free(lz->cache_used);
+  free(lz);
+}
+
+
+static void lazy_finalizer(SEXP ptr_) {
+  lazy_free((lazy_t *)R_ExternalPtrAddr(ptr_));
+  R_ClearExternalPtr(ptr_);
+}
+
+
+static lazy_t *lazy_get(SEXP x_) {
+  lazy_t *lz = (lazy_t *)R_ExternalPtrAddr(R_altrep_data1(x_));
+  if (lz == NULL) {
+    Rf_error("Lazy vector has been freed");
+  }
+  return lz;
+}
+
+
+static SEXP lazy_cache(SEXP x_) {
+  return VECTOR_ELT(R_ExternalPtrProtected(R_altrep_data1(x_)), 0);
+}
+
+
+static SEXP lazy_blocks(SEXP x_) {
+  return VECTOR_ELT(R_ExternalPtrProtected(R_altrep_data1(x_)), 1);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Block holding element 'i'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int lazy_block_of(lazy_t *lz, R_xlen_t i) {
+  int lo = 0, hi = lz->nblocks - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (lz->starts[mid] <= i) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The compressed bytes of block 'b'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP lazy_block_read(SEXP x_, lazy_t *lz, int b) {
+  if (lz->path == NULL) {
+    return VECTOR_ELT(lazy_blocks(x_), b);
+  }
+
+  SEXP raw_ = PROTECT(Rf_allocVector(RAWSXP, lz->lengths[b]));
+  FILE *fp = fopen(lz->path, "rb");
+  if (fp == NULL) {
+    Rf_error("Couldn't open '%s' to read lazy vector", lz->path);
+  }
+#ifndef _WIN32
+  int status = fseeko(fp, (off_t)lz->offsets[b], SEEK_SET);
+#else
+  int status = _fseeki64(fp, (int64_t)lz->offsets[b], SEEK_SET);
+#endif
+  size_t nread = status == 0 ? fread(RAW(raw_), 1, (size_t)lz->lengths[b], fp) : 0;
+  fclose(fp);
+  if (nread != (size_t)lz->lengths[b]) {
+    Rf_error("Couldn't read block %i of lazy vector from '%s'", b + 1, lz->path);
+  }
+  UNPROTECT(1);
+  return raw_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read and decode block 'b'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP lazy_block_decode(SEXP x_, lazy_t *lz, int b) {
+  SEXP raw_ = PROTECT(lazy_block_read(x_, lz, b));
+  SEXP dec_ = PROTECT(lz4_decompress_(raw_, R_NilValue, R_NilValue));
+
+  int type = lz->type == LGLSXP ? INTSXP : lz->type;
+  if (TYPEOF(dec_) != type || Rf_xlength(dec_) != lz->starts[b + 1] - lz->starts[b]) {
+    Rf_error("Block %i of lazy vector is corrupt", b + 1);
+  }
+  if (lz->type == LGLSXP) {
+    SEXP lgl_ = PROTECT(Rf_allocVector(LGLSXP, Rf_xlength(dec_)));
+    memcpy(LOGICAL(lgl_), INTEGER(dec_), (size_t)Rf_xlength(dec_) * sizeof(int));
+    UNPROTECT(3);
+    return lgl_;
+  }
+  UNPROTECT(2);
+  return dec_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decoded block 'b', from the cache if it's there.  Otherwise it's
+// decoded into the least recently used slot.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP lazy_block(SEXP x_, int b) {
+  lazy_t *lz = lazy_get(x_);
+  SEXP cache_ = lazy_cache(x_);
+
+  int slot = 0;
+  for (int s = 0; s < lz->ncache; s++) {
+    if (lz->cache_block[s] == b) {
+      lz->cache_used[s] = ++lz->clock;
+      return VECTOR_ELT(cache_, s);
+    }
+    if (lz->cache_used[s] < lz->cache_used[slot]) {
+      slot = s;
+    }
+  }
+
+  SET_VECTOR_ELT(cache_, slot, R_NilValue);
+  lz->cache_block[slot] = -1;
+  SEXP dec_ = lazy_block_decode(x_, lz, b);
+  SET_VECTOR_ELT(cache_, slot, dec_);
+  lz->cache_block[slot] = b;
+  lz->cache_used[slot]  = ++lz->clock;
+  return dec_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decode the whole vector into data2 (once), and empty the cache
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP lazy_expand(SEXP x_) {
+  SEXP full_ = R_altrep_data2(x_);
+  if (full_ != R_NilValue) {
+    return full_;
+  }
+
+  lazy_t *lz = lazy_get(x_);
+  full_ = PROTECT(Rf_allocVector(lz->type, lz->n));
+  for (int b = 0; b < lz->nblocks; b++) {
+    SEXP blk_ = PROTECT(lazy_block(x_, b));
+    R_xlen_t start = lz->starts[b];
+    R_xlen_t len   = lz->starts[b + 1] - start;
+    if (lz->type == STRSXP) {
+      for (R_xlen_t i = 0; i < len; i++) {
+        SET_STRING_ELT(full_, start + i, STRING_ELT(blk_, i));
+      }
+    } else {
+      size_t size = lz->type == REALSXP ? sizeof(double) : sizeof(int);
+      memcpy((char *)DATAPTR(full_) + (size_t)start * size, DATAPTR(blk_), (size_t)len * size);
+    }
+    UNPROTECT(1);
+  }
+  R_set_altrep_data2(x_, full_);
+
+  SEXP cache_ = lazy_cache(x_);
+  for (int s = 0; s < lz->ncache; s++) {
+    SET_VECTOR_ELT(cache_, s, R_NilValue);
+    lz->cache_block[s] = -1;
+    lz->cache_used[s]  = 0;
+  }
+
+  UNPROTECT(1);
+  return full_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// ALTREP methods
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static R_xlen_t lazy_Length(SEXP x_) {
+  return lazy_get(x_)->n;
+}
+
+
+static Rboolean lazy_Inspect(SEXP x_, int pre, int deep, int pvec,
+                             void (*inspect_subtree)(SEXP, int, int, int)) {
+  lazy_t *lz = lazy_get(x_);
+  Rprintf("lz4 lazy %s, %i blocks%s\n", Rf_type2char((SEXPTYPE)lz->type), lz->nblocks,
+          R_altrep_data2(x_) == R_NilValue ? "" : ", expanded");
+  return TRUE;
+}
+
+
+static SEXP lazy_Duplicate(SEXP x_, Rboolean deep) {
+  if (R_altrep_data2(x_) != R_NilValue) {
+    return NULL; // R copies the expanded vector
+  }
+  // Blocks never change, so the copy shares them (and the cache)
+  lazy_t *lz = lazy_get(x_);
+  R_altrep_class_t cls =
+    lz->type == REALSXP ? lazy_real_class    :
+    lz->type == INTSXP  ? lazy_integer_class :
+    lz->type == LGLSXP  ? lazy_logical_class : lazy_string_class;
+  return R_new_altrep(cls, R_altrep_data1(x_), R_NilValue);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Vectors with blocks in memory are serialized as their blocks, so stay
+// compressed when saved and loaded.  Otherwise (NULL) R writes the 
+// elements as for an ordinary vector
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP lazy_new_memory(int type, SEXP starts_, SEXP blocks_, int ncache);
+
+static SEXP lazy_Serialized_state(SEXP x_) {
+  lazy_t *lz = lazy_get(x_);
+  if (lz->path != NULL || R_altrep_data2(x_) != R_NilValue) {
+    return NULL;
+  }
+  SEXP state_  = PROTECT(Rf_allocVector(VECSXP, 4));
+  SEXP starts_ = PROTECT(Rf_allocVector(REALSXP, lz->nblocks + 1));
+  for (int b = 0; b <= lz->nblocks; b++) {
+    REAL(starts_)[b] = (double)lz->starts[b];
+  }
+  SET_VECTOR_ELT(state_, 0, Rf_ScalarInteger(lz->type));
+  SET_VECTOR_ELT(state_, 1, starts_);
+  SET_VECTOR_ELT(state_, 2, lazy_blocks(x_));
+  SET_VECTOR_ELT(state_, 3, Rf_ScalarInteger(lz->ncache));
+  UNPROTECT(2);
+  return state_;
+}
+
+
+static SEXP lazy_Unserialize(SEXP class_, SEXP state_) {
+  return lazy_new_memory(
+    Rf_asInteger(VECTOR_ELT(state_, 0)), 
+    VECTOR_ELT(state_, 1), 
+    VECTOR_ELT(state_, 2), 
+    Rf_asInteger(VECTOR_ELT(state_, 3))
+  );
+}
+
+
+static void *lazy_Dataptr(SEXP x_, Rboolean writeable) {
+  return DATAPTR(lazy_expand(x_));
+}
+
+
+static const void *lazy_Dataptr_or_null(SEXP x_) {
+  SEXP full_ = R_altrep_data2(x_);
+  return full_ == R_NilValue ? NULL : DATAPTR(full_);
+}
+
+
+static double lazy_real_Elt(SEXP x_, R_xlen_t i) {
+  SEXP full_ = R_altrep_data2(x_);
+  if (full_ != R_NilValue) {
+    return REAL(full_)[i];
+  }
+  lazy_t *lz = lazy_get(x_);
+  int b = lazy_block_of(lz, i);
+  return REAL(lazy_block(x_, b))[i - lz->starts[b]];
+}
+
+
+static int lazy_integer_Elt(SEXP x_, R_xlen_t i) {
+  SEXP full_ = R_altrep_data2(x_);
+  if (full_ != R_NilValue) {
+    return INTEGER(full_)[i];
+  }
+  lazy_t *lz = lazy_get(x_);
+  int b = lazy_block_of(lz, i);
+  return INTEGER(lazy_block(x_, b))[i - lz->starts[b]];
+}
+
+
+static int lazy_logical_Elt(SEXP x_, R_xlen_t i) {
+  SEXP full_ = R_altrep_data2(x_);
+  if (full_ != R_NilValue) {
+    return LOGICAL(full_)[i];
+  }
+  lazy_t *lz = lazy_get(x_);
+  int b = lazy_block_of(lz, i);
+  return LOGICAL(lazy_block(x_, b))[i - lz->starts[b]];
+}
+
+
+static SEXP lazy_string_Elt(SEXP x_, R_xlen_t i) {
+  SEXP full_ = R_altrep_data2(x_);
+  if (full_ != R_NilValue) {
+    return STRING_ELT(full_, i);
+  }
+  lazy_t *lz = lazy_get(x_);
+  int b = lazy_block_of(lz, i);
+  return STRING_ELT(lazy_block(x_, b), i - lz->starts[b]);
+}
+
+
+static void lazy_string_Set_elt(SEXP x_, R_xlen_t i, SEXP v_) {
+  SET_STRING_ELT(lazy_expand(x_), i, v_);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Copy elements [i, i + n) into 'buf', one block at a time
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static R_xlen_t lazy_get_region(SEXP x_, R_xlen_t i, R_xlen_t n, void *buf, size_t size) {
+  lazy_t *lz = lazy_get(x_);
+  if (i >= lz->n) return 0;
+  if (n > lz->n - i) n = lz->n - i;
+
+  SEXP full_ = R_altrep_data2(x_);
+  if (full_ != R_NilValue) {
+    memcpy(buf, (char *)DATAPTR(full_) + (size_t)i * size, (size_t)n * size);
+    return n;
+  }
+
+  R_xlen_t done = 0;
+  while (done < n) {
+    int b = lazy_block_of(lz, i + done);
+    R_xlen_t offset = i + done - lz->starts[b];
+    R_xlen_t len    = lz->starts[b + 1] - lz->starts[b] - offset;
+    if (len > n - done) len = n - done;
+    memcpy((char *)buf + (size_t)done * size,
+           (char *)DATAPTR(lazy_block(x_, b)) + (size_t)offset * size, (size_t)len * size);
+    done += len;
+  }
+  return n;
+}
+
+
+static R_xlen_t lazy_real_Get_region(SEXP x_, R_xlen_t i, R_xlen_t n, double *buf) {
+  return lazy_get_region(x_, i, n, buf, sizeof(double));
+}
+
+
+static R_xlen_t lazy_integer_Get_region(SEXP x_, R_xlen_t i, R_xlen_t n, int *buf) {
+  return lazy_get_region(x_, i, n, buf, sizeof(int));
+}
+
+
+void lz4_lazy_init(DllInfo *info) {
+  lazy_real_class = R_make_altreal_class("lz4_lazy_real", "lz4lite", info);
+  R_set_altrep_Length_method           (lazy_real_class, lazy_Length);
+  R_set_altrep_Inspect_method          (lazy_real_class, lazy_Inspect);
+  R_set_altrep_Serialized_state_method (lazy_real_class, lazy_Serialized_state);
+  R_set_altrep_Unserialize_method      (lazy_real_class, lazy_Unserialize);
+  R_set_altrep_Duplicate_method        (lazy_real_class, lazy_Duplicate);
+  R_set_altvec_Dataptr_method          (lazy_real_class, lazy_Dataptr);
+  R_set_altvec_Dataptr_or_null_method  (lazy_real_class, lazy_Dataptr_or_null);
+  R_set_altreal_Elt_method             (lazy_real_class, lazy_real_Elt);
+  R_set_altreal_Get_region_method      (lazy_real_class, lazy_real_Get_region);
+
+  lazy_integer_class = R_make_altinteger_class("lz4_lazy_integer", "lz4lite", info);
+  R_set_altrep_Length_method           (lazy_integer_class, lazy_Length);
+  R_set_altrep_Inspect_method          (lazy_integer_class, lazy_Inspect);
+  R_set_altrep_Serialized_state_method (lazy_integer_class, lazy_Serialized_state);
+  R_set_altrep_Unserialize_method      (lazy_integer_class, lazy_Unserialize);
+  R_set_altrep_Duplicate_method        (lazy_integer_class, lazy_Duplicate);
+  R_set_altvec_Dataptr_method          (lazy_integer_class, lazy_Dataptr);
+  R_set_altvec_Dataptr_or_null_method  (lazy_integer_class, lazy_Dataptr_or_null);
+  R_set_altinteger_Elt_method          (lazy_integer_class, lazy_integer_Elt);
+  R_set_altinteger_Get_region_method   (lazy_integer_class, lazy_integer_Get_region);
+
+  lazy_logical_class = R_make_altlogical_class("lz4_lazy_logical", "lz4lite", info);
+  R_set_altrep_Length_method           (lazy_logical_class, lazy_Length);
+  R_set_altrep_Inspect_method          (lazy_logical_class, lazy_Inspect);
+  R_set_altrep_Serialized_state_method (lazy_logical_class, lazy_Serialized_state);
+  R_set_altrep_Unserialize_method      (lazy_logical_class, lazy_Unserialize);
+  R_set_altrep_Duplicate_method        (lazy_logical_class, lazy_Duplicate);
+  R_set_altvec_Dataptr_method          (lazy_logical_class, lazy_Dataptr);
+  R_set_altvec_Dataptr_or_null_method  (lazy_logical_class, lazy_Dataptr_or_null);
+  R_set_altlogical_Elt_method          (lazy_logical_class, lazy_logical_Elt);
+  R_set_altlogical_Get_region_method   (lazy_logical_class, lazy_integer_Get_region);
+
+  lazy_string_class = R_make_altstring_class("lz4_lazy_string", "lz4lite", info);
+  R_set_altrep_Length_method           (lazy_string_class, lazy_Length);
+  R_set_altrep_Inspect_method          (lazy_string_class, lazy_Inspect);
+  R_set_altrep_Serialized_state_method (lazy_string_class, lazy_Serialized_state);
+  R_set_altrep_Unserialize_method      (lazy_string_class, lazy_Unserialize);
+  R_set_altrep_Duplicate_method        (lazy_string_class, lazy_Duplicate);
+  R_set_altvec_Dataptr_method          (lazy_string_class, lazy_Dataptr);
+  R_set_altvec_Dataptr_or_null_method  (lazy_string_class, lazy_Dataptr_or_null);
+  R_set_altstring_Elt_method           (lazy_string_class, lazy_string_Elt);
+  R_set_altstring_Set_elt_method       (lazy_string_class, lazy_string_Set_elt);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Allocate a 'lazy_t' with 'starts_' (numeric, one more than the number
+// of blocks) and an empty cache.  Frees it and raises an error on failure
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static lazy_t *lazy_alloc(int type, SEXP starts_, int ncache) {
+  if (type != REALSXP && type != INTSXP && type != LGLSXP && type != STRSXP) {
+    Rf_error("Lazy vectors must be numeric, integer, logical or character");
+  }
+  if (TYPEOF(starts_) != REALSXP || Rf_length(starts_) < 2) {
+    Rf_error("Bad block positions for lazy vector");
+  }
+  if (ncache == NA_INTEGER || ncache < 1) {
+    Rf_error("'cache' must be a positive integer");
+  }
+  int nblocks = Rf_length(starts_) - 1;
+
+  lazy_t *lz = (lazy_t *)calloc(1, sizeof(lazy_t));
+  if (lz == NULL) {
+    Rf_error("Couldn't allocate lazy vector");
+  }
+  lz->type        = type;
+  lz->nblocks     = nblocks;
+  lz->ncache      = ncache;
+  lz->starts      = (R_xlen_t *)malloc(((size_t)nblocks + 1) * sizeof(R_xlen_t));
+  lz->cache_block = (int *)malloc((size_t)ncache * sizeof(int));
+  lz->cache_used  = (uint64_t *)calloc((size_t)ncache, sizeof(uint64_t));
+  if (lz->starts == NULL || lz->cache_block == NULL || lz->cache_used == NULL) {
+    lazy_free(lz);
+    Rf_error("Couldn't allocate lazy vector");
+  }
+
+  const double *starts = REAL(starts_);
+  for (int b = 0; b <= nblocks; b++) {
+    lz->starts[b] = (R_xlen_t)starts[b];
+    if (!(starts[b] >= 0) || (b > 0 && lz->starts[b] < lz->starts[b - 1])) {
+      lazy_free(lz);
+      Rf_error("Bad block positions for lazy vector");
+    }
+  }
+  lz->n = lz->starts[nblocks];
+  for (int s = 0; s < ncache; s++) {
+    lz->cache_block[s] = -1;
+  }
+  return lz;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Wrap 'lz' (which is freed with the result) in an ALTREP vector
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP lazy_wrap(lazy_t *lz, SEXP blocks_) {
+  SEXP prot_ = PROTECT(Rf_allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(prot_, 0, Rf_allocVector(VECSXP, lz->ncache));
+  SET_VECTOR_ELT(prot_, 1, blocks_);
+  SEXP ptr_ = PROTECT(R_MakeExternalPtr(lz, R_NilValue, prot_));
+  R_RegisterCFinalizerEx(ptr_, lazy_finalizer, TRUE);
+
+  R_altrep_class_t cls =
+    lz->type == REALSXP ? lazy_real_class    :
+    lz->type == INTSXP  ? lazy_integer_class :
+    lz->type == LGLSXP  ? lazy_logical_class : lazy_string_class;
+  SEXP res_ = R_new_altrep(cls, ptr_, R_NilValue);
+
+  UNPROTECT(2);
+  return res_;
+}
+
+
+static SEXP lazy_new_memory(int type, SEXP starts_, SEXP blocks_, int ncache) {
+  if (TYPEOF(blocks_) != VECSXP || Rf_length(blocks_) != Rf_length(starts_) - 1) {
+    Rf_error("Bad blocks for lazy vector");
+  }
+  for (R_xlen_t b = 0; b < Rf_xlength(blocks_); b++) {
+    if (TYPEOF(VECTOR_ELT(blocks_, b)) != RAWSXP) {
+      Rf_error("Bad blocks for lazy vector");
+    }
+  }
+  return lazy_wrap(lazy_alloc(type, starts_, ncache), blocks_);
+}
+
+
+static int lazy_type(SEXP type_) {
+  if (!Rf_isString(type_) || Rf_length(type_) != 1) {
+    Rf_error("'type' must be a string");
+  }
+  return Rf_str2type(CHAR(STRING_ELT(type_, 0)));
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Create a lazy vector from blocks in memory
+//
+// @param type_ "double", "integer", "logical" or "character"
+// @param starts_ index (from 0) of the first element of each block,
+//        followed by the vector's length
+// @param blocks_ list of raw vectors, each from 'lz4_compress()'
+// @param cache_ number of decoded blocks to keep
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_lazy_memory_(SEXP type_, SEXP starts_, SEXP blocks_, SEXP cache_) {
+  return lazy_new_memory(lazy_type(type_), starts_, blocks_, Rf_asInteger(cache_));
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Create a lazy vector from blocks in a file
+//
+// @param type_,starts_,cache_ as above
+// @param file_ filename
+// @param offsets_,lengths_ position and size of each block in the file
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_lazy_file_(SEXP type_, SEXP starts_, SEXP file_, SEXP offsets_, SEXP lengths_,
+                    SEXP cache_) {
+
+  if (!Rf_isString(file_) || Rf_length(file_) != 1) {
+    Rf_error("'file' must be a string");
+  }
+  int nblocks = Rf_length(starts_) - 1;
+  if (TYPEOF(offsets_) != REALSXP || TYPEOF(lengths_) != REALSXP ||
+      Rf_length(offsets_) != nblocks || Rf_length(lengths_) != nblocks) {
+    Rf_error("Bad block positions for lazy vector");
+  }
+  const char *filename = R_ExpandFileName(Rf_translateChar(STRING_ELT(file_, 0)));
+
+  lazy_t *lz = lazy_alloc(lazy_type(type_), starts_, Rf_asInteger(cache_));
+  lz->path    = (char *)malloc(strlen(filename) + 1);
+  lz->offsets = (double *)malloc((size_t)nblocks * sizeof(double));
+  lz->lengths = (int *)malloc((size_t)nblocks * sizeof(int));
+  if (lz->path == NULL || lz->offsets == NULL || lz->lengths == NULL) {
+    lazy_free(lz);
+    Rf_error("Couldn't allocate lazy vector");
+  }
+  strcpy(lz->path, filename);
+  for (int b = 0; b < nblocks; b++) {
+    lz->offsets[b] = REAL(offsets_)[b];
+    lz->lengths[b] = (int)REAL(lengths_)[b];
+  }
+
+  return lazy_wrap(lz, R_NilValue);
+}
@@ -0,0 +1,9 @@
+#ifndef LZ4_LAZY_H
+#define LZ4_LAZY_H
+
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+void lz4_lazy_init(DllInfo *info);
+
+#endif
@@ -0,0 +1,237 @@
+
+#include <string.h>
+
+#include "lz4.h"
+#include "lz4-rle.h"
+#include "lz4-dispatch.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Run-length encoding of stream blocks.
+//
+// Nothing in this file depends on R. 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// Runs must cover at least this fraction of a block (in 1/8ths) for it to
+// be run-length encoded rather than compressed by LZ4 alone.
+#define RLE_MIN_FILL_8THS 6
+
+// Op flags
+#define OP_FILL 1  // a run, rather than literal bytes
+#define OP_SAME 2  // a run with the same pattern as the previous run
+
+// Longest varint for an op
+#define OP_MAX_BYTES 5
+
+
+static inline uint64_t load64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+
+static inline uint8_t *put_op(uint8_t *op, uint32_t len, uint32_t flags) {
+  uint32_t v = len << 2 | flags;
+  while (v >= 0x80) {
+    *op++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *op++ = (uint8_t)v;
+  return op;
+}
+
+
+// Returns NULL if the op runs past 'end'
+static inline const uint8_t *get_op(const uint8_t *op, const uint8_t *end, uint32_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 7 * OP_MAX_BYTES; shift += 7) {
+    if (op == end) return NULL;
+    uint8_t b = *op++;
+    *v |= (uint32_t)(b & 0x7F) << shift;
+    if (b < 0x80) return op;
+  }
+  return NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// End of the run which starts at 'i', or 'i' if there isn't one.
+// Compares 8 bytes at a time against the 8 bytes before them.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline int run_end(const uint8_t *src, int i, int len) {
+  int k = i + 8;
+  while (k + 8 <= len && load64(src + k) == load64(src + k - 8)) {
+    k += 8;
+  }
+  while (k < len && src[k] == src[k - 8]) {
+    k++;
+  }
+  return k;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Encode a block as runs plus LZ4-compressed literals.
+//
+// 'scratch' must hold 'len' bytes. Returns the encoded length, or 0 if runs 
+// don't cover enough of the block to be worthwhile (or 'dst' is too small)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int rle_encode(const uint8_t *src, int len, uint8_t *dst, int dst_capacity, 
+               uint8_t *scratch, int acceleration) {
+  
+  uint8_t *op  = dst + sizeof(uint32_t);
+  uint8_t *end = dst + dst_capacity;
+  uint8_t *lit = scratch;
+  uint32_t nops = 0;
+  uint64_t pattern = 0;
+  int filled = 0;
+  
+  // Once past the first eighth of the block, give up as soon as runs 
+  // cover too little of what has been scanned.  Blocks which aren't
+  // worth encoding are then rejected cheaply
+  int lit_start = 0;
+  int i = 0;
+  while (i + RLE_MIN_RUN <= len) {
+    if (i > len / 8 && filled < i / 8 * RLE_MIN_FILL_8THS) return 0;
+    
+    // R writes data in multiples of 4 bytes, so runs rarely start 
+    // between these positions and scanning is 4x faster
+    if (load64(src + i) != load64(src + i + 8)) {
+      i += 4;
+      continue;
+    }
+    int j = run_end(src, i, len);
+    if (j - i < RLE_MIN_RUN) {
+      i += 4;
+      continue;
+    }
+    
+    // Ops for the literal bytes before this run, and the run itself
+    if (end - op < 2 * OP_MAX_BYTES + 8) return 0;
+    if (i > lit_start) {
+      op = put_op(op, i - lit_start, 0);
+      memcpy(lit, src + lit_start, i - lit_start);
+      lit += i - lit_start;
+      nops++;
+    }
+    if (nops > 0 && load64(src + i) == pattern) {
+      op = put_op(op, j - i, OP_FILL | OP_SAME);
+    } else {
+      op = put_op(op, j - i, OP_FILL);
+      memcpy(op, src + i, 8); op += 8;
+      pattern = load64(src + i);
+    }
+    nops++;
+    
+    filled += j - i;
+    i = lit_start = j;
+  }
+  
+  if (filled < len / 8 * RLE_MIN_FILL_8THS) {
+    return 0;
+  }
+  
+  if (lit_start < len) {
+    if (end - op < OP_MAX_BYTES) return 0;
+    op = put_op(op, len - lit_start, 0);
+    memcpy(lit, src + lit_start, len - lit_start);
+    lit += len - lit_start;
+    nops++;
+  }
+  memcpy(dst, &nops, sizeof(nops));
+  
+  // Literals are compressed independently of the stream's history
+  int lit_len = (int)(lit - scratch);
+  if (lit_len > 0) {
+    if (end - op < LZ4_compressBound(lit_len)) return 0;
+    int comp_len = lz4_kernels.compress_fast((const char *)scratch, (char *)op, 
+                                             lit_len, (int)(end - op), acceleration);
+    if (comp_len <= 0) return 0;
+    op += comp_len;
+  }
+  
+  return (int)(op - dst);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Fill 'len' bytes with a repeating 8 byte pattern
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void fill(uint8_t *dst, uint64_t pattern, int len) {
+  uint8_t b = (uint8_t)pattern;
+  if (pattern == 0x0101010101010101ULL * b) {
+    memset(dst, b, len);
+    return;
+  }
+  int k = 0;
+  for (; k + 8 <= len; k += 8) {
+    memcpy(dst + k, &pattern, 8);
+  }
+  memcpy(dst + k, &pattern, len - k);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decode an encoded block of 'len' bytes into exactly 'dst_len' bytes.
+//
+// The literals are first decompressed into the end of 'dst', then 
+// expanded forwards in place.  Output never overtakes the unread literals.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int rle_decode(const uint8_t *src, int len, uint8_t *dst, int dst_len) {
+  if (len < (int)sizeof(uint32_t)) return RLE_ERROR;
+  
+  uint32_t nops;
+  memcpy(&nops, src, sizeof(nops));
+  const uint8_t *ops = src + sizeof(uint32_t);
+  const uint8_t *end = src + len;
+  
+  // Validate the ops, and find the total size of the literals
+  int64_t total = 0, lit_len = 0;
+  const uint8_t *p = ops;
+  for (uint32_t k = 0; k < nops; k++) {
+    uint32_t v;
+    p = get_op(p, end, &v);
+    if (p == NULL) return RLE_ERROR;
+    if ((v & OP_FILL) == 0) {
+      lit_len += v >> 2;
+    } else if ((v & OP_SAME) == 0) {
+      if (end - p < 8) return RLE_ERROR;
+      p += 8;
+    } else if (k == 0) {
+      return RLE_ERROR;
+    }
+    total += v >> 2;
+    if (total > dst_len) return RLE_ERROR;
+  }
+  if (total != dst_len) return RLE_ERROR;
+  
+  uint8_t *lit = dst + dst_len - lit_len;
+  if (lit_len > 0) {
+    int res = lz4_kernels.decompress_safe((const char *)p, (char *)lit, 
+                                          (int)(end - p), (int)lit_len);
+    if (res != lit_len) return RLE_ERROR;
+  } else if (p != end) {
+    return RLE_ERROR;
+  }
+  
+  uint8_t *out = dst;
+  uint64_t pattern = 0;
+  for (uint32_t k = 0; k < nops; k++) {
+    uint32_t v;
+    ops = get_op(ops, end, &v);
+    int n = (int)(v >> 2);
+    if (v & OP_FILL) {
+      if ((v & OP_SAME) == 0) {
+        pattern = load64(ops);
+        ops += 8;
+      }
+      fill(out, pattern, n);
+    } else {
+      memmove(out, lit, n);
+      lit += n;
+    }
+    out += n;
+  }
+  
+  return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef LZ4_RLE_H
+#define LZ4_RLE_H
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Run-length encoding of stream blocks, independent of R.
+//
+// A run is a stretch of bytes which repeats with a period of 8, so it 
+// covers runs of any repeated byte, 4-byte integer or 8-byte double 
+// (e.g. zeros or NA) regardless of alignment.
+//
+// Encoded block
+//   - uint32 number of ops
+//   - ops: varint (length << 2 | flags), followed by the 8 byte pattern
+//     for fills which don't reuse the previous pattern
+//   - all literal bytes, concatenated and compressed as one LZ4 block
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stdint.h>
+
+// Shortest run worth encoding
+#define RLE_MIN_RUN 64
+
+#define RLE_ERROR -1
+
+int rle_encode(const uint8_t *src, int len, uint8_t *dst, int dst_capacity, 
+               uint8_t *scratch, int acceleration);
+int rle_decode(const uint8_t *src, int len, uint8_t *dst, int dst_len);
+
+#endif
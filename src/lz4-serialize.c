@@ -5,90 +5,148 @@
 #include <Rinternals.h>
 #include <Rdefines.h>
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 
-#include "lz4.h"
-
+#include <R_ext/Connections.h>
+#if !defined(R_CONNECTIONS_VERSION) || R_CONNECTIONS_VERSION != 1
+#error "Unsupported connections API version"
+#endif
 
-#define BUF_SIZE 512 * 1024
+#include "lz4.h"
+#include "lz4-serialize.h"
+#include "lz4-codec.h"
+#include "lz4-altrep.h"
 
-// Source / Destination mode
-#define MODE_RAW    1
-#define MODE_FILE   2
 
-// Direction modes
-#define MODE_UNSERIALIZE   8
-#define MODE_SERIALIZE    16                                           
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Context pool
+//
+// A context is over 1MB (two 512kB buffers, a compressed buffer and the
+// LZ4 state), so rather than allocating one per call, a few are kept and 
+// reset between uses.  R is single threaded, so a simple stack suffices.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define POOL_SIZE     2
+#define POOL_OUT_MAX  (4 * BUF_SIZE) // Don't keep very large output buffers
 
+static dbuf_t *db_pool[POOL_SIZE];
+static int db_pool_n = 0;
 
 
-typedef struct {
-  int mode;
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Get a context for 'mode' and reset it.
+//
+// If a codec is given, its own context and settings are used. Otherwise
+// a context is taken from the pool (or created).
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+dbuf_t *db_acquire(int mode, lz4_codec_t *codec) {
   
-  // For file output
-  FILE *file;
+  dbuf_t *db;
   
-  // For raw vector output
-  uint8_t *raw;
-  int raw_capacity;
-  int raw_pos;
+  if (codec != NULL && !codec->db_busy) {
+    db = codec->db;
+    codec->db_busy = true;
+  } else if (db_pool_n > 0) {
+    db = db_pool[--db_pool_n];
+  } else {
+    db = db_new();
+  }
   
-  // Double bufferes
-  uint8_t buf[2][BUF_SIZE];
-  int idx;              // which buffer is active
-  uint32_t pos;         // position within active buffer
-  uint32_t data_length; // total data length in active buffer (for reading)
+  if (db == NULL) {
+    Rf_error("Couldn't allocate double buffer");
+  }
   
-  // For LZ4
-  LZ4_stream_t       *stream_out;  // compression
-  LZ4_streamDecode_t *stream_in;   // decompression
-  int acceleration;                // range [1, 65535]
-  uint8_t *comp;                   // compressed buffer
-  int comp_capacity;               // capacity of compressed buffer
+  if (db_reset(db, mode) < 0) {
+    db_release(db, true);
+    Rf_error("%s", db->errmsg);
+  }
   
-  bool checked_magic;
-} dbuf_t;
-
+  if (codec != NULL) {
+    db->acceleration = codec->acceleration;
+    db->block_size   = codec->block_size;
+  }
+  
+  // An adaptive codec carries on from the acceleration it last reached
+  if (codec != NULL && mode & MODE_SERIALIZE && codec->target_mbps > 0) {
+    db->acceleration = codec->acc_reached;
+    db->target_mbps  = codec->target_mbps;
+  }
+  
+  if (codec != NULL && mode & MODE_SERIALIZE) {
+    lz4_codec_attach_dict(codec, db->stream_out);
+  }
+  
+  return db;
+}
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// Compress the current buffer and output
+// Release all resources held for the current call, and return the context
+// to the pool.  
+//
+// This is called whether or not the call completed, so 'jump' 
+// indicates an error (or interrupt) unwound the call part way through.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_compressed_buf(dbuf_t *db) {
-  int comp_len = LZ4_compress_fast_continue(
-    db->stream_out,                  // Stream
-    (const char *)db->buf[db->idx],  // Source Raw Buffer
-                         (char *)db->comp,                // Dest Compressed buffer
-                         db->pos,                         // Source size
-                         db->comp_capacity,               // dstCapacity
-                         db->acceleration
-  );
-  if (comp_len < 0) Rf_error("Error compression lz4");
+void db_release(dbuf_t *db, bool jump) {
   
-  if (db->mode & MODE_FILE) {
-    fwrite(&db->pos, 1, sizeof(uint32_t), db->file); // Write raw length
-    fwrite(&comp_len, 1, sizeof(int32_t), db->file); // write compressed length
-    fwrite(db->comp, 1, comp_len, db->file);  // Write compressed buffer
-  } else if (db->mode & MODE_RAW) {
-    
-    if (db->raw_pos + 2 * sizeof(uint32_t) + comp_len >= db->raw_capacity) {
-      db->raw_capacity *= 2;
-      db->raw = realloc(db->raw, db->raw_capacity);
-    }
-    
-    memcpy(db->raw + db->raw_pos, &db->pos ,        4); db->raw_pos += 4;
-    memcpy(db->raw + db->raw_pos, &comp_len,        4); db->raw_pos += 4;
-    memcpy(db->raw + db->raw_pos, db->comp , comp_len); db->raw_pos += comp_len;
-    
+  if (db->file != NULL) {
+    fclose(db->file);
+    db->file = NULL;
+  }
+  
+  // Keep the output buffer for next time, unless it has grown very large.
+  if (db->mode & MODE_SERIALIZE && db->mode & MODE_RAW && db->raw != NULL) {
+    db->out          = db->raw;
+    db->out_capacity = db->raw_capacity;
+  }
+  db->raw = NULL;
+  if (db->out_capacity > POOL_OUT_MAX) {
+    free(db->out);
+    db->out          = NULL;
+    db->out_capacity = 0;
+  }
+  
+  // An LZ4 error leaves the stream in a state which must be fully re-initialised
+  if (jump && db->stream_out != NULL) {
+    LZ4_initStream(db->stream_out, sizeof(LZ4_stream_t));
+  }
+  
+  if (db->owner != NULL && db->target_mbps > 0) {
+    db->owner->acc_reached = db->acceleration;
+  }
+  
+  if (db->owner != NULL) {
+    db->owner->db_busy = false;
+  } else if (db_pool_n < POOL_SIZE) {
+    db_pool[db_pool_n++] = db;
   } else {
-    Rf_error("write_compressed_buf(): unknown mode");
-  }    
+    db_free(db);
+  }
 }
 
 
+void db_cleanup(void *data, Rboolean jump) {
+  dbuf_t *db = (dbuf_t *)data;
+  if (!jump) {
+    lz4_stats_end(db->stats);
+  }
+  db_release(db, jump);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Free all pooled contexts. Called when the package is unloaded
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void db_pool_free(void) {
+  while (db_pool_n > 0) {
+    db_free(db_pool[--db_pool_n]);
+  }
+}
+
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -102,57 +160,64 @@ void write_compressed_buf(dbuf_t *db) {
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// Finalise the context after serializing/unserializing
+// Finalise the context after serializing/unserializing.
+// Resources are released separately by 'db_release()'
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 SEXP db_finalize(dbuf_t *db) {
   
   int nprotect = 0;
   SEXP res_ = R_NilValue;
   
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Small object fast path.
+  // If serializing to raw and everything fitted in the first block then 
+  // compress it directly into an exact-sized result.  The staging buffer
+  // is never touched.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (db->mode & MODE_SERIALIZE && db->mode & MODE_RAW && db->raw == NULL) {
+    int comp_len = db_compress_block(db);
+    if (comp_len < 0) Rf_error("%s", db->errmsg);
+    uint32_t header = db_block_header(db);
+    const uint8_t *data = db_block_data(db);
+    
+    res_ = PROTECT(Rf_allocVector(RAWSXP, 4 + 2 * sizeof(uint32_t) + comp_len));
+    uint8_t *dst = RAW(res_);
+    memcpy(dst     , STREAM_MAGIC,        4);
+    memcpy(dst +  4, &header     ,        4);
+    memcpy(dst +  8, &comp_len   ,        4);
+    memcpy(dst + 12, data        , comp_len);
+    UNPROTECT(1);
+    return res_;
+  }
+  
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Flush any contents of the write buffers
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (db->mode & MODE_SERIALIZE) {
-    write_compressed_buf(db);
+  if (db->mode & MODE_SERIALIZE && db_write_block(db) < 0) {
+    Rf_error("%s", db->errmsg);
   }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Close the file
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (db->mode & MODE_FILE) {
-    fclose(db->file);
+    uint64_t start = db->stats == NULL ? 0 : lz4_stats_now();
+    int status = fclose(db->file);
+    db->file = NULL;
+    if (db->stats != NULL) db->stats->ns_io += lz4_stats_now() - start;
+    if (status != 0 && db->mode & MODE_SERIALIZE) {
+      Rf_error("Error writing to file");
+    }
   }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // When serializzing to raw, create an R raw vector and then free the
-  // allocated memory in C
+  // When serializing to raw, create an R raw vector from the output buffer
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (db->mode & MODE_RAW && db->mode & MODE_SERIALIZE) {
     res_ = PROTECT(Rf_allocVector(RAWSXP, db->raw_pos)); nprotect++;
     memcpy(RAW(res_), db->raw, db->raw_pos);
-    free(db->raw);
   }
   
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Free the LZ4 encoding stream
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (db->mode & MODE_SERIALIZE) {
-    LZ4_freeStream(db->stream_out);
-  }
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Free the LZ4 decoding stream
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (db->mode & MODE_UNSERIALIZE) {
-    LZ4_freeStreamDecode(db->stream_in);
-  }
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Both serialize and unserialize use the same comrpession buffer. Free it.
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  free(db->comp);
-  free(db);
-  
   UNPROTECT(nprotect);
   return res_;
 }
@@ -174,30 +239,9 @@ void write_byte_stream(R_outpstream_t stream, int c) {
 
 void write_bytes_stream(R_outpstream_t stream, void *src, int length) {
   dbuf_t *db = (dbuf_t *)stream->data;
-  
-  
-  // If this 'write' would overflow the size of the current buffer, 
-  // then write out the current buffer and switch to the other.
-  // Remember: We need to keep these historical bytes around so that
-  // the lz4 compression has a data reference of 64kB
-  if (db->pos + length >= BUF_SIZE) {
-    write_compressed_buf(db); // compress and write the current buffer
-    db->idx = 1 - db->idx;    // switch buffers
-    db->pos = 0;              // reset buffer position
-  } 
-  
-  
-  // This should never happen.  R serialization infrastrucutre seems
-  // to work in chunks of 8k items. This is ~64k for floating point doubles
-  // and should never exceed BUF_SIZE
-  if (db->pos + length >= BUF_SIZE) {
-    Rf_error("Out-of-range write %i/%i", length, BUF_SIZE);
+  if (db_write(db, src, length) < 0) {
+    Rf_error("%s", db->errmsg);
   }
-  
-  
-  // Append data to the current buffer
-  memcpy(db->buf[db->idx] + db->pos, src, length);
-  db->pos += length;
 }
 
 
@@ -211,26 +255,82 @@ void write_bytes_stream(R_outpstream_t stream, void *src, int length) {
 //  #   #  #      #        #    #   #    #      #     #     #     
 //   ###    ###   #       ###    ####   ###    ###   #####   ###  
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP lz4_serialize_(SEXP x_, SEXP dst_, SEXP acc_, SEXP dict_) {
-  
-  // Allocate the double-buffer context
-  dbuf_t *db = calloc(1, sizeof(dbuf_t));
-  if (db == NULL) {
-    Rf_error("Couldn't allocate double buffer");
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// I/O callbacks for R connections.
+//
+// Blocks are passed to the connection as they are compressed, so pipes and
+// sockets see a steady stream at constant memory.  Reads are for exactly
+// the bytes of each block, so nothing after the end of the stream is 
+// consumed from the connection.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t conn_write(void *io_ctx, const void *src, size_t n) {
+  return R_WriteConnection((Rconnection)io_ctx, (void *)src, n);
+}
+
+
+static size_t conn_read(void *io_ctx, void *dst, size_t n) {
+  // Pipes and sockets may return less than was asked for
+  size_t total = 0;
+  while (total < n) {
+    size_t nread = R_ReadConnection((Rconnection)io_ctx, (uint8_t *)dst + total, n - total);
+    if (nread == 0) break;
+    total += nread;
+  }
+  return total;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Use an open R connection for I/O
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void db_use_connection(dbuf_t *db, SEXP con_) {
+  db->mode    |= MODE_CALLBACK;
+  db->io_ctx   = R_GetConnection(con_);
+  db->io_write = conn_write;
+  db->io_read  = conn_read;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Arguments for a serialize/unserialize call. Passed through 
+// R_UnwindProtect() so that the context is always returned to the pool 
+// even if R raises an error part way through.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  dbuf_t *db;
+  SEXP x_;     // Object to serialize
+  SEXP io_;    // 'dst' for serialize. 'src' for unserialize
+  SEXP acc_;
+  SEXP dict_;
+  double target_mbps; // If > 0, adapt acceleration to meet this throughput
+  lz4_codec_t *codec; // If not NULL, overrides 'acc_', 'dict_' and 'target_mbps'
+  int typed;          // Write character vectors as typed frames
+} lz4_call_t;
+
+
+SEXP lz4_serialize_body(void *data) {
+  lz4_call_t *call = (lz4_call_t *)data;
+  dbuf_t *db = call->db;
+  SEXP dst_  = call->io_;
+  SEXP dict_ = call->dict_;
+  
+  // Set the user option for 'acceleration'. With a target throughput, 
+  // this is only the starting point
+  if (call->codec == NULL) {
+    db->acceleration = Rf_asInteger(call->acc_);
+    db->target_mbps  = call->target_mbps;
   }
-  
-  
-  // Set the user option for 'acceleration'
-  db->acceleration = Rf_asInteger(acc_);
-  db->mode = MODE_SERIALIZE;
   
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Set up the destination:
+  //   - connection  => output to an open connection
   //   - character   => output to file
   //   - NULL or raw => output to a raw vector
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (TYPEOF(dst_) == STRSXP) {
+  if (Rf_inherits(dst_, "connection")) {
+    db_use_connection(db, dst_);
+  } else if (TYPEOF(dst_) == STRSXP) {
     db->mode |= MODE_FILE;
     const char *filename = CHAR(STRING_ELT(dst_, 0));
     db->file = fopen(filename, "wb");
@@ -239,27 +339,17 @@ SEXP lz4_serialize_(SEXP x_, SEXP dst_, SEXP acc_, SEXP dict_) {
     }
   } else if (Rf_isNull(dst_) || TYPEOF(dst_) == RAWSXP) {
     db->mode |= MODE_RAW;
-    db->raw_pos      = 0;
-    db->raw_capacity = BUF_SIZE;
-    db->raw          = malloc(BUF_SIZE);
-    if (db->raw == NULL) Rf_error("Couldn't initialize raw buffer");
+    // Staging buffer is set up by 'db_raw_begin()' once the first block is full
   } else {
     Rf_error("Don't know how to deal with 'dst' of type: [%i] %s", 
              TYPEOF(dst_), Rf_type2char(TYPEOF(dst_)));
   }
   
   
-  // Setup LZ4 encoding stream context
-  db->stream_out    = LZ4_createStream();
-  db->comp_capacity = LZ4_COMPRESSBOUND(BUF_SIZE);
-  db->comp          = malloc(db->comp_capacity);
-  if (db->comp == NULL) {
-    Rf_error("lz4_serialize() couldnt allocate compressed buffer");
-  }
-  
-  
-  // Dictionary
-  if (TYPEOF(dict_) == RAWSXP) {
+  // Dictionary. A codec's dictionary is already attached to the stream
+  if (call->codec != NULL) {
+    // Nothing to do
+  } else if (TYPEOF(dict_) == RAWSXP) {
     int res = LZ4_loadDict(db->stream_out, (const char *)RAW(dict_), (int)Rf_length(dict_));
     if (res <= 0) {
       Rf_error("Error loading dictionary");
@@ -269,12 +359,8 @@ SEXP lz4_serialize_(SEXP x_, SEXP dst_, SEXP acc_, SEXP dict_) {
   }
   
   // Write magic
-  char *magic = "LZ4S";
-  if (db->mode & MODE_FILE) {
-    fwrite(magic, 1, 4, db->file);
-  } else {
-    memcpy(db->raw, magic, 4);
-    db->raw_pos += 4;
+  if (db->mode & (MODE_FILE | MODE_CALLBACK) && db_write_magic(db) < 0) {
+    Rf_error("%s", db->errmsg);
   }
 
   // Create & initialise the output stream structure
@@ -292,7 +378,10 @@ SEXP lz4_serialize_(SEXP x_, SEXP dst_, SEXP acc_, SEXP dict_) {
 
   
   // Serialize the object into the output_stream
+  SEXP x_ = call->typed ? lz4_typed_wrap(call->x_) : call->x_;
+  PROTECT(x_);
   R_Serialize(x_, &output_stream);
+  UNPROTECT(1);
 
   // Flush buffers to output, close.
   // Return vector if serializing to raw.
@@ -300,6 +389,35 @@ SEXP lz4_serialize_(SEXP x_, SEXP dst_, SEXP acc_, SEXP dict_) {
 }
 
 
+SEXP lz4_serialize_(SEXP x_, SEXP dst_, SEXP acc_, SEXP dict_, SEXP codec_, SEXP typed_,
+                    SEXP target_mbps_) {
+  
+  lz4_stats_t stats;
+  lz4_stats_t *st = lz4_stats_begin(&stats, STATS_OP_SERIALIZE);
+  
+  lz4_codec_t *codec = lz4_codec_get(codec_);
+  double target_mbps = lz4_target_mbps(target_mbps_);
+  
+  lz4_call_t call = {
+    .db          = db_acquire(MODE_SERIALIZE, codec),
+    .x_          = x_,
+    .io_         = dst_,
+    .acc_        = acc_,
+    .dict_       = dict_,
+    .target_mbps = target_mbps,
+    .codec       = codec,
+    .typed       = Rf_asLogical(typed_) == TRUE
+  };
+  
+  call.db->stats = st;
+  
+  SEXP cont_ = PROTECT(R_MakeUnwindCont());
+  SEXP res_  = R_UnwindProtect(lz4_serialize_body, &call, db_cleanup, call.db, cont_);
+  UNPROTECT(1);
+  return res_;
+}
+
+
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //  ####                     # 
@@ -318,76 +436,9 @@ int read_byte_stream(R_inpstream_t stream) {
 
 void read_bytes_stream(R_inpstream_t stream, void *dst, int length) {
   dbuf_t *db = (dbuf_t *)stream->data;
-  
-  while (db->pos + length > db->data_length) {
-    // Not enough bytes to satisfy the request. So:
-    //  - copy across available bytes
-    //  - load the next buffer
-    
-    // Copy across available bytes
-    int nbytes = db->data_length - db->pos; // bytes left in current buffer
-    memcpy(dst, db->buf[db->idx] + db->pos, nbytes);
-    length -= nbytes;
-    
-    db->idx = 1 - db->idx; // switch buffers
-    db->pos = 0;           // Reset position
-    
-    if (!db->checked_magic) {
-      db->checked_magic = true;
-      if (db->mode & MODE_RAW) {
-        if (memcmp("LZ4S", db->raw, 4) != 0) {
-          Rf_error("Raw vector is not a lz4 serialized stream");
-        }
-        db->raw_pos += 4;
-      } else {
-        char buf[10];
-        unsigned long nread = fread(buf, 1, 4, db->file);
-        if (nread != 4 || strncmp(buf, "LZ4S", 4) != 0) {
-          Rf_error("File is not a lz4 serialized stream");
-        }
-      }
-    }
-    
-    
-    // Read 
-    //   - buffer length, 
-    //   - compressed length
-    //   - compressed data
-    int comp_len;
-    
-    if (db->mode & MODE_FILE) {
-      unsigned long nread = fread(&db->data_length, 1, sizeof(uint32_t), db->file);
-      if (nread != 4) Rf_error("Error reading 4 byte data length");
-      nread = fread(&comp_len, 1, sizeof(int32_t), db->file);
-      if (nread != 4) Rf_error("Error reading 4 byte compressed length");
-      nread = fread(db->comp, 1, comp_len, db->file);
-      if (nread != comp_len) Rf_error("Error reading compressed data of length %i", (int)nread);
-    } else if (db->mode & MODE_RAW) {
-      memcpy (&db->data_length, db->raw + db->raw_pos,        4); db->raw_pos += 4;
-      memcpy (&comp_len       , db->raw + db->raw_pos,        4); db->raw_pos += 4;
-      memcpy(db->comp         , db->raw + db->raw_pos, comp_len); db->raw_pos += comp_len;
-      
-    } else {
-      Rf_error("Unserialize [000]");  
-    }
-    
-    // Decompress
-    int res = LZ4_decompress_safe_continue(
-      db->stream_in,             // Stream
-      (const char *)db->comp,    // Src compressed buffer
-      (char *)db->buf[db->idx],  // Dst raw buffer
-      comp_len,                  // Src size
-      BUF_SIZE                   // Compressed size
-    );
-    if (res < 0) {
-      Rf_error("Lz4 decompression error %i", res);
-    }
+  if (db_read(db, dst, length) < 0) {
+    Rf_error("%s", db->errmsg);
   }
-  
-  
-  // copy across bytes
-  memcpy(dst, db->buf[db->idx] + db->pos, length);
-  db->pos += length;
 }
 
 
@@ -400,19 +451,16 @@ void read_bytes_stream(R_inpstream_t stream, void *dst, int length) {
 //  #   #  #   #      #  #      #        #    #   #    #      #     #     #     
 //   ###   #   #  ####    ###   #       ###    ####   ###    ###   #####   ###  
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP lz4_unserialize_(SEXP src_, SEXP dict_) {
-
-  // Allocate double-buffer context
-  dbuf_t *db = calloc(1, sizeof(dbuf_t));
-  if (db == NULL) {
-    Rf_error("Couldn't allocate double buffer");
-  }
-  
-  db->mode = MODE_UNSERIALIZE;
-  
-  
-  // Set input type to be raw vector or a filename
-  if (TYPEOF(src_) == STRSXP) {
+SEXP lz4_unserialize_body(void *data) {
+  lz4_call_t *call = (lz4_call_t *)data;
+  dbuf_t *db = call->db;
+  SEXP src_  = call->io_;
+  SEXP dict_ = call->dict_;
+  
+  // Set input type to be a connection, raw vector or a filename
+  if (Rf_inherits(src_, "connection")) {
+    db_use_connection(db, src_);
+  } else if (TYPEOF(src_) == STRSXP) {
     db->mode |= MODE_FILE;
     const char *filename = CHAR(STRING_ELT(src_, 0));
     db->file = fopen(filename, "rb");
@@ -430,15 +478,6 @@ SEXP lz4_unserialize_(SEXP src_, SEXP dict_) {
   }
   
   
-  // LZ4 stream handling
-  db->stream_in     = LZ4_createStreamDecode();
-  db->comp_capacity = LZ4_COMPRESSBOUND(BUF_SIZE);
-  db->comp          = malloc(db->comp_capacity);
-  if (db->comp == NULL) {
-    Rf_error("lz4_unserialize() couldnt allocate compressed buffer");
-  }
-  
-  
   // Dictionary
   if (TYPEOF(dict_) == RAWSXP) {
     int res = LZ4_setStreamDecode(db->stream_in, (const char *)RAW(dict_), (int)Rf_length(dict_));
@@ -471,3 +510,25 @@ SEXP lz4_unserialize_(SEXP src_, SEXP dict_) {
   return res_;
 }
 
+
+SEXP lz4_unserialize_(SEXP src_, SEXP dict_, SEXP codec_) {
+  
+  lz4_stats_t stats;
+  lz4_stats_t *st = lz4_stats_begin(&stats, STATS_OP_UNSERIALIZE);
+  
+  lz4_codec_t *codec = lz4_codec_get(codec_);
+  
+  lz4_call_t call = {
+    .db    = db_acquire(MODE_UNSERIALIZE, codec),
+    .io_   = src_,
+    .dict_ = codec == NULL ? dict_ : codec->dict_,
+    .codec = codec
+  };
+  
+  call.db->stats = st;
+  
+  SEXP cont_ = PROTECT(R_MakeUnwindCont());
+  SEXP res_  = R_UnwindProtect(lz4_unserialize_body, &call, db_cleanup, call.db, cont_);
+  UNPROTECT(1);
+  return res_;
+}
@@ -0,0 +1,19 @@
+#ifndef LZ4_SERIALIZE_H
+#define LZ4_SERIALIZE_H
+
+#include <Rinternals.h>
+#include <stdbool.h>
+
+#include "lz4-stream.h"
+
+struct lz4_codec_st;
+
+dbuf_t *db_acquire(int mode, struct lz4_codec_st *codec);
+void    db_release(dbuf_t *db, bool jump);
+void    db_pool_free(void);
+void    db_use_connection(dbuf_t *db, SEXP con_);
+
+SEXP lz4_serialize_(SEXP x_, SEXP dst_, SEXP acc_, SEXP dict_, SEXP codec_, SEXP typed_,
+                    SEXP target_mbps_);
+
+#endif
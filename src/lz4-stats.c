@@ -0,0 +1,203 @@
+
+#define R_NO_REMAP
+
+#include <R.h>
+#include <Rinternals.h>
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "lz4-stats.h"
+#include "lz4-trace.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Process-wide statistics.  R is single threaded, so plain globals suffice.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static bool stats_enabled = false;
+
+static bool        stats_have_last = false;
+static lz4_stats_t stats_last;
+
+static uint64_t    stats_calls[STATS_OP_COUNT];
+static lz4_stats_t stats_total[STATS_OP_COUNT];
+static uint64_t    stats_call_hist[STATS_OP_COUNT][STATS_BINS];
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Start collecting stats for a call.
+//
+// Returns 'stats' if collection or trace recording is enabled, otherwise 
+// NULL. The returned pointer is what should be passed to the timed code.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+lz4_stats_t *lz4_stats_begin(lz4_stats_t *stats, int op) {
+  if (!stats_enabled && !lz4_trace_recording) {
+    return NULL;
+  }
+  memset(stats, 0, sizeof(lz4_stats_t));
+  stats->op    = op;
+  stats->start = lz4_stats_now();
+  return stats;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Finish a call which completed successfully, and add it to the totals
+// and the trace
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void lz4_stats_end(lz4_stats_t *stats) {
+  if (stats == NULL) {
+    return;
+  }
+  stats->ns_total = lz4_stats_now() - stats->start;
+  
+  if (lz4_trace_recording) {
+    lz4_trace_record(TRACE_CALL_SERIALIZE + stats->op, stats->start, stats->ns_total,
+                     stats->bytes_raw, stats->bytes_comp);
+  }
+  
+  if (!stats_enabled) {
+    return;
+  }
+  
+  stats_last      = *stats;
+  stats_have_last = true;
+  
+  int op = stats->op;
+  lz4_stats_t *total = &stats_total[op];
+  stats_calls[op]++;
+  total->ns_total      += stats->ns_total;
+  total->ns_compress   += stats->ns_compress;
+  total->ns_decompress += stats->ns_decompress;
+  total->ns_io         += stats->ns_io;
+  total->bytes_raw     += stats->bytes_raw;
+  total->bytes_comp    += stats->bytes_comp;
+  total->blocks        += stats->blocks;
+  total->grows         += stats->grows;
+  total->direct        += stats->direct;
+  for (int i = 0; i < STATS_BINS; i++) {
+    total->block_hist[i] += stats->block_hist[i];
+  }
+  stats_call_hist[op][lz4_stats_bin(stats->ns_total)]++;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Numeric summary of a set of stats.  Times are in seconds.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define STATS_NFIELDS 10
+
+static void stats_fill(double *dst, int stride, uint64_t calls, lz4_stats_t *stats) {
+  dst[0 * stride] = (double)calls;
+  dst[1 * stride] = stats->ns_total      / 1e9;
+  dst[2 * stride] = stats->ns_compress   / 1e9;
+  dst[3 * stride] = stats->ns_decompress / 1e9;
+  dst[4 * stride] = stats->ns_io         / 1e9;
+  dst[5 * stride] = (double)stats->bytes_raw;
+  dst[6 * stride] = (double)stats->bytes_comp;
+  dst[7 * stride] = (double)stats->blocks;
+  dst[8 * stride] = (double)stats->grows;
+  dst[9 * stride] = (double)stats->direct;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Enable/disable/reset collection and return the current stats
+//
+// @param enable_ logical. NA to leave unchanged
+// @param reset_ logical. Clear all stats
+//
+// @return list of 
+//    - enabled: logical
+//    - last: numeric vector for the most recent call, or NULL
+//    - last_op: integer op of the most recent call
+//    - total: numeric matrix. One row per op
+//    - call_hist: numeric matrix of call latency. One row per op
+//    - block_hist: numeric matrix of block latency. One row per op
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_stats_(SEXP enable_, SEXP reset_) {
+  
+  int enable = Rf_asLogical(enable_);
+  if (enable != NA_LOGICAL) {
+    stats_enabled = enable;
+  }
+  
+  if (Rf_asLogical(reset_) == TRUE) {
+    stats_have_last = false;
+    memset(stats_calls    , 0, sizeof(stats_calls));
+    memset(stats_total    , 0, sizeof(stats_total));
+    memset(stats_call_hist, 0, sizeof(stats_call_hist));
+  }
+  
+  SEXP res_ = PROTECT(Rf_allocVector(VECSXP, 6));
+  SET_VECTOR_ELT(res_, 0, Rf_ScalarLogical(stats_enabled));
+  
+  if (stats_have_last) {
+    SEXP last_ = PROTECT(Rf_allocVector(REALSXP, STATS_NFIELDS));
+    stats_fill(REAL(last_), 1, 1, &stats_last);
+    SET_VECTOR_ELT(res_, 1, last_);
+    SET_VECTOR_ELT(res_, 2, Rf_ScalarInteger(stats_last.op));
+    UNPROTECT(1);
+  }
+  
+  SEXP total_      = PROTECT(Rf_allocMatrix(REALSXP, STATS_OP_COUNT, STATS_NFIELDS));
+  SEXP call_hist_  = PROTECT(Rf_allocMatrix(REALSXP, STATS_OP_COUNT, STATS_BINS));
+  SEXP block_hist_ = PROTECT(Rf_allocMatrix(REALSXP, STATS_OP_COUNT, STATS_BINS));
+  for (int op = 0; op < STATS_OP_COUNT; op++) {
+    stats_fill(REAL(total_) + op, STATS_OP_COUNT, stats_calls[op], &stats_total[op]);
+    for (int i = 0; i < STATS_BINS; i++) {
+      REAL(call_hist_ )[op + i * STATS_OP_COUNT] = (double)stats_call_hist[op][i];
+      REAL(block_hist_)[op + i * STATS_OP_COUNT] = (double)stats_total[op].block_hist[i];
+    }
+  }
+  SET_VECTOR_ELT(res_, 3, total_);
+  SET_VECTOR_ELT(res_, 4, call_hist_);
+  SET_VECTOR_ELT(res_, 5, block_hist_);
+  
+  UNPROTECT(4);
+  return res_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Start recording trace events
+//
+// @param max_events maximum number of events to keep
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_trace_start_(SEXP max_events_) {
+  int max_events = Rf_asInteger(max_events_);
+  if (max_events == NA_INTEGER || max_events <= 0) {
+    Rf_error("'max_events' must be a positive integer");
+  }
+  if (lz4_trace_start(max_events) < 0) {
+    Rf_error("Couldn't allocate trace buffer for %i events", max_events);
+  }
+  return R_NilValue;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Stop recording and write Chrome trace JSON to 'file_'
+//
+// @return number of events written
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP lz4_trace_stop_(SEXP file_) {
+  if (!lz4_trace_recording) {
+    Rf_error("Trace recording has not been started");
+  }
+  if (TYPEOF(file_) != STRSXP || Rf_length(file_) != 1) {
+    lz4_trace_free();
+    Rf_error("'file' must be a single filename");
+  }
+  
+  const char *filename = CHAR(STRING_ELT(file_, 0));
+  int dropped = 0;
+  int n = lz4_trace_write(filename, &dropped);
+  if (n < 0) {
+    Rf_error("Couldn't write trace to '%s'", filename);
+  }
+  if (dropped > 0) {
+    Rf_warning("%i trace events were dropped. Increase 'max_events'", dropped);
+  }
+  
+  return Rf_ScalarInteger(n);
+}
@@ -0,0 +1,79 @@
+#ifndef LZ4_STATS_H
+#define LZ4_STATS_H
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Performance statistics.
+//
+// Collection is opt-in via 'lz4_stats(TRUE)'. When disabled, calls are 
+// given a NULL stats pointer and nothing is timed.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stdint.h>
+#include <time.h>
+
+// Operations which are tracked
+#define STATS_OP_SERIALIZE    0
+#define STATS_OP_UNSERIALIZE  1
+#define STATS_OP_COMPRESS     2
+#define STATS_OP_DECOMPRESS   3
+#define STATS_OP_COUNT        4
+
+// Latency histograms have log2 bins. Bin 'i' counts latencies less than 
+// 2^(i + 1) nanoseconds. The last bin catches everything else (> 2s)
+#define STATS_BINS 32
+
+typedef struct {
+  int op;
+  uint64_t start;          // clock at start of call
+  
+  uint64_t ns_total;       // whole call
+  uint64_t ns_compress;    // in LZ4 compression
+  uint64_t ns_decompress;  // in LZ4 decompression
+  uint64_t ns_io;          // reading/writing file or output buffer
+  
+  uint64_t bytes_raw;      // uncompressed bytes
+  uint64_t bytes_comp;     // compressed bytes
+  uint64_t blocks;         // LZ4 blocks compressed or decompressed
+  uint64_t grows;          // output buffer (re)allocations
+  uint64_t direct;         // blocks decompressed straight into the destination
+  
+  uint64_t block_hist[STATS_BINS]; // latency of each block compress/decompress
+} lz4_stats_t;
+
+
+static inline uint64_t lz4_stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline int lz4_stats_bin(uint64_t ns) {
+  int bin = 0;
+  while (ns > 1 && bin < STATS_BINS - 1) {
+    ns >>= 1;
+    bin++;
+  }
+  return bin;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Record the timing of a single block compress/decompress
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline void lz4_stats_block(lz4_stats_t *stats, uint64_t ns, int raw_len, int comp_len) {
+  if (stats->op == STATS_OP_SERIALIZE || stats->op == STATS_OP_COMPRESS) {
+    stats->ns_compress += ns;
+  } else {
+    stats->ns_decompress += ns;
+  }
+  stats->bytes_raw  += raw_len;
+  stats->bytes_comp += comp_len;
+  stats->blocks++;
+  stats->block_hist[lz4_stats_bin(ns)]++;
+}
+
+
+lz4_stats_t *lz4_stats_begin(lz4_stats_t *stats, int op);
+void         lz4_stats_end(lz4_stats_t *stats);
+
+#endif
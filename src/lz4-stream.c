@@ -0,0 +1,741 @@
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "lz4.h"
+#include "lz4-stream.h"
+#include "lz4-rle.h"
+#include "lz4-trace.h"
+#include "lz4-dispatch.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Core LZ4T stream reading/writing.  
+//
+// Nothing in this file depends on R, so that it can also be built into the
+// standalone benchmark harness in 'microbench/'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Record an error message. Always returns DB_ERROR
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_set_error(dbuf_t *db, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(db->errmsg, sizeof(db->errmsg), fmt, args);
+  va_end(args);
+  return DB_ERROR;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Allocate a new context. Only the fields before the buffers are zeroed.
+// Returns NULL if allocation fails
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+dbuf_t *db_new(void) {
+  dbuf_t *db = malloc(sizeof(dbuf_t));
+  if (db == NULL) {
+    return NULL;
+  }
+  memset(db, 0, offsetof(dbuf_t, buf));
+  db->comp_capacity = LZ4_COMPRESSBOUND(BUF_SIZE);
+  db->comp          = malloc(db->comp_capacity);
+  if (db->comp == NULL) {
+    free(db);
+    return NULL;
+  }
+  return db;
+}
+
+
+void db_free(dbuf_t *db) {
+  if (db->stream_out != NULL) LZ4_freeStream(db->stream_out);
+  if (db->stream_in  != NULL) LZ4_freeStreamDecode(db->stream_in);
+  free(db->out);
+  free(db->comp);
+  free(db->scratch);
+  free(db);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Reset a context for a new stream in the given 'mode'.
+// The caller sets 'acceleration' and 'block_size' afterwards if needed.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_reset(dbuf_t *db, int mode) {
+  db->mode          = mode;
+  db->file          = NULL;
+  db->io_write      = NULL;
+  db->io_read       = NULL;
+  db->io_ctx        = NULL;
+  db->raw           = NULL;
+  db->raw_capacity  = 0;
+  db->raw_pos       = 0;
+  db->idx           = 0;
+  db->pos           = 0;
+  db->data_length   = 0;
+  db->block_len     = 0;
+  db->block_type    = BLOCK_LZ4;
+  db->acceleration  = 1;
+  db->target_mbps   = 0;
+  db->block_size    = BUF_SIZE;
+  db->checked_magic = false;
+  db->magic_v1      = false;
+  db->at_end        = false;
+  db->stats         = NULL;
+  db->errmsg[0]     = '\0';
+  
+  // LZ4 streams are created on first use, and cheaply reset thereafter
+  if (mode & MODE_SERIALIZE) {
+    if (db->stream_out == NULL) {
+      db->stream_out = LZ4_createStream();
+    } else {
+      LZ4_resetStream_fast(db->stream_out);
+    }
+  } else {
+    if (db->stream_in == NULL) {
+      db->stream_in = LZ4_createStreamDecode();
+    } else {
+      LZ4_setStreamDecode(db->stream_in, NULL, 0);
+    }
+  }
+  
+  if ((mode & MODE_SERIALIZE && db->stream_out == NULL) || 
+      (mode & MODE_UNSERIALIZE && db->stream_in == NULL)) {
+    return db_set_error(db, "Couldn't allocate LZ4 stream");
+  }
+  
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//  #   #           #     #           
+//  #   #                 #           
+//  #   #  # ##    ##    ####    ###  
+//  # # #  ##  #    #     #     #   # 
+//  # # #  #        #     #     ##### 
+//  ## ##  #        #     #  #  #     
+//  #   #  #       ###     ##    ###  
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Set up the staging buffer for writing to memory.
+//
+// This is only needed once the written data exceeds a single block.
+// Smaller streams can be compressed straight into their final destination
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_raw_begin(dbuf_t *db) {
+  if (db->out == NULL) {
+    db->out_capacity = BUF_SIZE;
+    db->out          = malloc(BUF_SIZE);
+    if (db->out == NULL) return db_set_error(db, "Couldn't initialize raw buffer");
+    if (db->stats != NULL) db->stats->grows++;
+  }
+  db->raw_capacity = db->out_capacity;
+  db->raw          = db->out;
+  db->out          = NULL; // now owned by 'raw' until released
+  
+  memcpy(db->raw, STREAM_MAGIC, 4);
+  db->raw_pos = 4;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Is 'src' so close to random that LZ4 is not worth running?
+//
+// Estimates the order-0 entropy of the bytes from evenly spaced samples. 
+// Already compressed or encrypted data is very close to 8 bits per byte.
+// Buffers too small to sample reliably are never judged incompressible.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define ENTROPY_SAMPLES      32
+#define ENTROPY_SAMPLE_SIZE 256
+#define ENTROPY_MAX_BITS    7.9
+
+bool lz4_incompressible(const uint8_t *src, int len) {
+  if (len < ENTROPY_SAMPLES * ENTROPY_SAMPLE_SIZE) return false;
+  
+  uint32_t count[256] = {0};
+  int stride = len / ENTROPY_SAMPLES;
+  for (int s = 0; s < ENTROPY_SAMPLES; s++) {
+    const uint8_t *p = src + (size_t)s * stride;
+    for (int k = 0; k < ENTROPY_SAMPLE_SIZE; k++) {
+      count[p[k]]++;
+    }
+  }
+  
+  double n = ENTROPY_SAMPLES * ENTROPY_SAMPLE_SIZE;
+  double bits = 0;
+  for (int b = 0; b < 256; b++) {
+    if (count[b] > 0) bits -= count[b] * log2(count[b] / n);
+  }
+  
+  return bits / n > ENTROPY_MAX_BITS;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Choose the acceleration for the next block from the throughput of the 
+// block just compressed in 'ns' nanoseconds.
+//
+// Too slow doubles the acceleration.  Faster than the target by ACC_SLACK
+// halves it, so the gap between the two thresholds stops it flip-flopping
+// between levels on noisy timings.  Short blocks are too noisy to use.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define ACC_SLACK 1.5
+
+static void db_adapt_acceleration(dbuf_t *db, uint64_t ns) {
+  if (db->pos < MIN_BLOCK_SIZE || ns == 0) return;
+  
+  double mbps = (double)db->pos / (double)ns * 1e3;
+  if (mbps < db->target_mbps) {
+    db->acceleration = db->acceleration > ACC_MAX / 2 ? ACC_MAX : db->acceleration * 2;
+  } else if (mbps > db->target_mbps * ACC_SLACK && db->acceleration > ACC_MIN) {
+    db->acceleration /= 2;
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress the current buffer into 'db->comp'. Returns compressed length.
+//
+// Blocks which are mostly long runs (e.g. zeros or NAs) are run-length 
+// encoded instead, and incompressible blocks are stored as-is. 
+// 'db->block_type' records which was used.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_compress_block(dbuf_t *db) {
+  bool timed = db->stats != NULL || db->target_mbps > 0 || TRACE_ACTIVE(stream_compress);
+  uint64_t start = timed ? lz4_stats_now() : 0;
+  
+  int type = BLOCK_LZ4;
+  int comp_len = 0;
+  bool tried = true; // Was compression attempted?
+  
+  // Run-length encoding is an optimisation only, so failing to allocate
+  // its scratch space just means it isn't tried
+  if (lz4_incompressible(db->buf[db->idx], db->pos)) {
+    type  = BLOCK_STORED;
+    tried = false;
+  } else if (db->pos >= 2 * RLE_MIN_RUN) {
+    if (db->scratch == NULL) db->scratch = malloc(BUF_SIZE);
+    if (db->scratch != NULL) {
+      comp_len = rle_encode(db->buf[db->idx], db->pos, db->comp, db->comp_capacity, 
+                            db->scratch, db->acceleration);
+      if (comp_len > 0) type = BLOCK_RLE;
+    }
+  }
+  
+  if (type == BLOCK_LZ4) {
+    comp_len = lz4_kernels.compress_fast_continue(
+      db->stream_out,                  // Stream
+      (const char *)db->buf[db->idx],  // Source Raw Buffer
+      (char *)db->comp,                // Dest Compressed buffer
+      db->pos,                         // Source size
+      db->comp_capacity,               // dstCapacity
+      db->acceleration
+    );
+    if (comp_len <= 0) return db_set_error(db, "Error compression lz4");
+    
+    // LZ4 made it bigger. Store it instead, for a faster decode
+    if (comp_len >= db->pos) type = BLOCK_STORED;
+  }
+  
+  if (type == BLOCK_STORED) comp_len = db->pos;
+  
+  // The next LZ4 block must not refer back past a block of another type
+  if (type != BLOCK_LZ4) LZ4_resetStream_fast(db->stream_out);
+  db->block_type = type;
+  
+  if (timed) {
+    uint64_t ns = lz4_stats_now() - start;
+    if (db->stats != NULL) lz4_stats_block(db->stats, ns, db->pos, comp_len);
+    TRACE_BLOCK(stream_compress, TRACE_STREAM_COMPRESS, start, ns, db->pos, comp_len);
+    
+    // Acceleration has no effect on the time taken to store a block
+    if (db->target_mbps > 0 && tried) db_adapt_acceleration(db, ns);
+  }
+  
+  return comp_len;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The uncompressed length field for the block just compressed
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+uint32_t db_block_header(dbuf_t *db) {
+  return db->pos | (uint32_t)db->block_type << BLOCK_TYPE_SHIFT;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The data to write for the block just compressed. Stored blocks are 
+// written straight from the double buffer.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+const uint8_t *db_block_data(dbuf_t *db) {
+  return db->block_type == BLOCK_STORED ? db->buf[db->idx] : db->comp;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Sequential I/O for files and callbacks. 
+// Returns the number of bytes transferred
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t db_io_write(dbuf_t *db, const void *src, size_t n) {
+  if (db->mode & MODE_FILE) return fwrite(src, 1, n, db->file);
+  return db->io_write(db->io_ctx, src, n);
+}
+
+static size_t db_io_read(dbuf_t *db, void *dst, size_t n) {
+  if (db->mode & MODE_FILE) return fread(dst, 1, n, db->file);
+  return db->io_read(db->io_ctx, dst, n);
+}
+
+static const char *db_io_name(dbuf_t *db) {
+  return db->mode & MODE_FILE ? "file" : "connection";
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write the magic bytes at the start of a file or callback stream
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_write_magic(dbuf_t *db) {
+  if (db_io_write(db, STREAM_MAGIC, 4) != 4) {
+    return db_set_error(db, "Error writing to %s", db_io_name(db));
+  }
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress the current buffer and output
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_write_block(dbuf_t *db) {
+  int comp_len = db_compress_block(db);
+  if (comp_len < 0) return DB_ERROR;
+  uint32_t header = db_block_header(db);
+  const uint8_t *data = db_block_data(db);
+  
+  uint64_t start = db->stats == NULL ? 0 : lz4_stats_now();
+  
+  if (db->mode & (MODE_FILE | MODE_CALLBACK)) {
+    if (db_io_write(db, &header  , sizeof(uint32_t)) != sizeof(uint32_t) || // Write raw length
+        db_io_write(db, &comp_len, sizeof(int32_t))  != sizeof(int32_t)  || // write compressed length
+        db_io_write(db, data     , comp_len)         != comp_len) {         // Write compressed buffer
+      return db_set_error(db, "Error writing to %s", db_io_name(db));
+    }
+  } else if (db->mode & MODE_RAW) {
+    
+    if (db->raw == NULL && db_raw_begin(db) < 0) {
+      return DB_ERROR;
+    }
+    
+    while (db->raw_pos + 2 * sizeof(uint32_t) + comp_len >= db->raw_capacity) {
+      uint8_t *raw = realloc(db->raw, 2 * db->raw_capacity);
+      if (raw == NULL) return db_set_error(db, "Couldn't grow raw output buffer");
+      db->raw = raw;
+      db->raw_capacity *= 2;
+      if (db->stats != NULL) db->stats->grows++;
+    }
+    
+    memcpy(db->raw + db->raw_pos, &header  ,        4); db->raw_pos += 4;
+    memcpy(db->raw + db->raw_pos, &comp_len,        4); db->raw_pos += 4;
+    memcpy(db->raw + db->raw_pos, data     , comp_len); db->raw_pos += comp_len;
+    
+  } else {
+    return db_set_error(db, "db_write_block(): unknown mode");
+  }
+  
+  if (db->stats != NULL) {
+    db->stats->ns_io += lz4_stats_now() - start;
+  }
+  
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Append bytes to the stream
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_write(dbuf_t *db, const void *src, int length) {
+  
+  // If this 'write' would overflow the size of the current buffer, 
+  // then write out the current buffer and switch to the other.
+  // Remember: We need to keep these historical bytes around so that
+  // the lz4 compression has a data reference of 64kB
+  if (db->pos > 0 && db->pos + length >= db->block_size) {
+    if (db_write_block(db) < 0) return DB_ERROR; // compress and write the current buffer
+    db->idx = 1 - db->idx;    // switch buffers
+    db->pos = 0;              // reset buffer position
+  } 
+  
+  
+  // This should never happen.  R serialization infrastrucutre seems
+  // to work in chunks of 8k items. This is ~64k for floating point doubles
+  // and should never exceed BUF_SIZE
+  if (db->pos + length >= BUF_SIZE) {
+    return db_set_error(db, "Out-of-range write %i/%i", length, BUF_SIZE);
+  }
+  
+  
+  // Append data to the current buffer
+  memcpy(db->buf[db->idx] + db->pos, src, length);
+  db->pos += length;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Append any number of bytes to the stream. 
+// Each block is filled to 'block_size' and written as soon as it is full.
+// A partial block stays buffered until the next write, or until the 
+// caller writes it with 'db_write_block()'.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_write_all(dbuf_t *db, const void *src, size_t length) {
+  const uint8_t *p = (const uint8_t *)src;
+  
+  // A block filling the whole buffer would end exactly where the other 
+  // buffer begins, and LZ4 would then treat the two blocks as one 
+  // contiguous prefix. Stop one byte short so that each block depends
+  // only on the one before it.
+  size_t limit = db->block_size < BUF_SIZE ? db->block_size : BUF_SIZE - 1;
+  
+  while (length > 0) {
+    size_t room = limit - db->pos;
+    size_t n = length < room ? length : room;
+    memcpy(db->buf[db->idx] + db->pos, p, n);
+    db->pos += n;
+    p       += n;
+    length  -= n;
+    
+    if (db->pos == limit) {
+      if (db_write_block(db) < 0) return DB_ERROR;
+      db->idx = 1 - db->idx;
+      db->pos = 0;
+    }
+  }
+  
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//  ####                     # 
+//  #   #                    # 
+//  #   #   ###    ###    ## # 
+//  ####   #   #      #  #  ## 
+//  # #    #####   ####  #   # 
+//  #  #   #      #   #  #  ## 
+//  #   #   ###    ####   ## # 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Check the 4 magic bytes at the start of a stream.
+// Returns 0 for a current stream, 1 for one from lz4lite 1.0.0, or -1 if 
+// this is not a stream at all
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_check_magic(const void *src) {
+  if (memcmp(src, STREAM_MAGIC   , 4) == 0) return 0;
+  if (memcmp(src, STREAM_MAGIC_V1, 4) == 0) return 1;
+  return -1;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read the header and compressed bytes of the next block into 'db->comp'
+//
+// Sets 'db->block_len' and 'db->block_type' for this block and 
+// returns the compressed length
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_read_block(dbuf_t *db) {
+  
+  uint64_t start = db->stats == NULL ? 0 : lz4_stats_now();
+  
+  if (!db->checked_magic) {
+    db->checked_magic = true;
+    int version;
+    if (db->mode & MODE_RAW) {
+      if (db->raw_capacity < 4 || (version = db_check_magic(db->raw)) < 0) {
+        return db_set_error(db, "Raw vector is not a lz4 serialized stream");
+      }
+      db->raw_pos += 4;
+    } else {
+      char buf[10];
+      size_t nread = db_io_read(db, buf, 4);
+      if (nread != 4 || (version = db_check_magic(buf)) < 0) {
+        return db_set_error(db, "%s is not a lz4 serialized stream", 
+                            db->mode & MODE_FILE ? "File" : "Connection");
+      }
+    }
+    db->magic_v1 = version == 1;
+  }
+  
+  
+  // Read 
+  //   - buffer length, 
+  //   - compressed length
+  //   - compressed data
+  int comp_len;
+  
+  if (db->mode & (MODE_FILE | MODE_CALLBACK)) {
+    size_t nread = db_io_read(db, &db->block_len, sizeof(uint32_t));
+    db->at_end = nread == 0;
+    if (nread != 4) return db_set_error(db, "Error reading 4 byte data length");
+    nread = db_io_read(db, &comp_len, sizeof(int32_t));
+    if (nread != 4) return db_set_error(db, "Error reading 4 byte compressed length");
+    if (comp_len < 0 || comp_len > db->comp_capacity) {
+      return db_set_error(db, "Corrupt compressed length: %i", comp_len);
+    }
+    nread = db_io_read(db, db->comp, comp_len);
+    if (nread != comp_len) return db_set_error(db, "Error reading compressed data of length %i", (int)nread);
+  } else if (db->mode & MODE_RAW) {
+    db->at_end = db->raw_pos == db->raw_capacity;
+    if (db->raw_pos + 2 * sizeof(uint32_t) > db->raw_capacity) {
+      return db_set_error(db, "Unexpected end of lz4 serialized stream");
+    }
+    memcpy (&db->block_len, db->raw + db->raw_pos,        4); db->raw_pos += 4;
+    memcpy (&comp_len     , db->raw + db->raw_pos,        4); db->raw_pos += 4;
+    if (comp_len < 0 || comp_len > db->comp_capacity || 
+        db->raw_pos + comp_len > db->raw_capacity) {
+      return db_set_error(db, "Corrupt compressed length: %i", comp_len);
+    }
+    memcpy(db->comp       , db->raw + db->raw_pos, comp_len); db->raw_pos += comp_len;
+  } else {
+    return db_set_error(db, "Unserialize [000]");  
+  }
+  
+  db->block_type = (int)(db->block_len >> BLOCK_TYPE_SHIFT);
+  db->block_len &= BLOCK_LEN_MASK;
+  if (db->block_len > BUF_SIZE) {
+    return db_set_error(db, "Corrupt block length: %u", db->block_len);
+  }
+  if (db->magic_v1 && db->block_type != BLOCK_LZ4) {
+    return db_set_error(db, "Corrupt block type %i in an \"LZ4S\" stream", db->block_type);
+  }
+  if (db->block_type > BLOCK_STORED) {
+    return db_set_error(db, "Unsupported block type %i. The stream may be from a newer "
+                        "version of lz4lite", db->block_type);
+  }
+  
+  if (db->stats != NULL) {
+    db->stats->ns_io += lz4_stats_now() - start;
+  }
+  
+  return comp_len;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress the block currently held in 'db->comp' into 'dst'.
+//
+// 'dst' may be one of the double buffers, or it may be memory owned by 
+// the caller.  The stream decoder treats the previous block as an external
+// dictionary if 'dst' is not contiguous with it.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_decompress_block(dbuf_t *db, int comp_len, uint8_t *dst, int dst_capacity) {
+  bool timed = db->stats != NULL || TRACE_ACTIVE(stream_decompress);
+  uint64_t start = timed ? lz4_stats_now() : 0;
+  
+  int res;
+  if (db->block_type == BLOCK_STORED) {
+    if (comp_len != db->block_len || db->block_len > dst_capacity) {
+      return db_set_error(db, "Corrupt stored block length: %i", comp_len);
+    }
+    memcpy(dst, db->comp, comp_len);
+    res = comp_len;
+    LZ4_setStreamDecode(db->stream_in, NULL, 0);
+  } else if (db->block_type == BLOCK_RLE) {
+    if (db->block_len > dst_capacity || 
+        rle_decode(db->comp, comp_len, dst, db->block_len) < 0) {
+      return db_set_error(db, "Corrupt run-length encoded block");
+    }
+    res = db->block_len;
+    LZ4_setStreamDecode(db->stream_in, NULL, 0);
+  } else {
+    res = lz4_kernels.decompress_safe_continue(
+      db->stream_in,             // Stream
+      (const char *)db->comp,    // Src compressed buffer
+      (char *)dst,               // Dst raw buffer
+      comp_len,                  // Src size
+      dst_capacity               // Dst capacity
+    );
+    if (res < 0 || res != db->block_len) {
+      return db_set_error(db, "Lz4 decompression error %i", res);
+    }
+  }
+  
+  if (timed) {
+    uint64_t ns = lz4_stats_now() - start;
+    if (db->stats != NULL) lz4_stats_block(db->stats, ns, res, comp_len);
+    TRACE_BLOCK(stream_decompress, TRACE_STREAM_DECOMPRESS, start, ns, res, comp_len);
+  }
+  
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress the block just read into the other buffer
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int db_buffer_block(dbuf_t *db, int comp_len) {
+  db->idx = 1 - db->idx;
+  db->pos = 0;
+  if (db_decompress_block(db, comp_len, db->buf[db->idx], BUF_SIZE) < 0) return DB_ERROR;
+  db->data_length = db->block_len;
+  return db->block_len;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress the block just read straight into 'dst' (which has room for
+// all of it), skipping the double buffer. 
+//
+// The decoder's history is then in 'dst', which is only valid until the
+// read returns.  Before that, 'db_keep_history()' must be called with 
+// the end of the bytes decoded this way.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int db_direct_block(dbuf_t *db, int comp_len, uint8_t *dst) {
+  if (db_decompress_block(db, comp_len, dst, db->block_len) < 0) return DB_ERROR;
+  db->pos = db->data_length = 0;
+  if (db->stats != NULL) db->stats->direct++;
+  return db->block_len;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Copy the (up to) 64kB of history before 'end' into the current buffer, 
+// which has been fully consumed, and point the decoder at it.  
+// 'len' bytes before 'end' were decoded straight into the caller's memory
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void db_keep_history(dbuf_t *db, const uint8_t *end, size_t len) {
+  int hist = len < HIST_SIZE ? (int)len : HIST_SIZE;
+  memcpy(db->buf[db->idx], end - hist, hist);
+  LZ4_setStreamDecode(db->stream_in, (const char *)db->buf[db->idx], hist);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read 'length' bytes from the stream into 'dst'
+//
+// Blocks which fit entirely in what is left of the request are decoded 
+// straight into 'dst'.  History is copied once per run of such blocks
+// rather than once per block, so this only saves copying when a single 
+// read covers well over 64kB.  R's unserializer reads vector data at most
+// 8096 elements (64768 bytes) at a time, so for 'lz4_unserialize()' the
+// direct path only runs with a codec 'block_size' smaller than that, and
+// then costs about the same as the double buffer.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_read(dbuf_t *db, void *dst, int length) {
+  uint8_t *out = (uint8_t *)dst;
+  size_t direct = 0; // bytes just before 'out' decoded straight into it
+  
+  while (db->pos + length > db->data_length) {
+    // Not enough bytes to satisfy the request. So:
+    //  - copy across available bytes
+    //  - load the next block
+    
+    // Copy across available bytes
+    int nbytes = db->data_length - db->pos; // bytes left in current buffer
+    memcpy(out, db->buf[db->idx] + db->pos, nbytes);
+    out    += nbytes;
+    length -= nbytes;
+    db->pos = db->data_length;
+    
+    int comp_len = db_read_block(db);
+    if (comp_len < 0) return DB_ERROR;
+    
+    if (db->block_len > 0 && db->block_len <= length) {
+      if (db_direct_block(db, comp_len, out) < 0) return DB_ERROR;
+      out    += db->block_len;
+      length -= db->block_len;
+      direct += db->block_len;
+    } else {
+      if (direct > 0) db_keep_history(db, out, direct);
+      direct = 0;
+      if (db_buffer_block(db, comp_len) < 0) return DB_ERROR;
+    }
+  }
+  
+  if (direct > 0) db_keep_history(db, out, direct);
+  
+  // copy across bytes
+  memcpy(out, db->buf[db->idx] + db->pos, length);
+  db->pos += length;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read and decompress the next block into the other buffer.
+// Returns the block length, or DB_ERROR (with 'at_end' set if the stream
+// simply ended).
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int db_next_block(dbuf_t *db) {
+  int comp_len = db_read_block(db);
+  if (comp_len < 0) return DB_ERROR;
+  return db_buffer_block(db, comp_len);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read up to 'length' bytes from the stream. 
+// Returns the number of bytes read, which is less than 'length' only at 
+// the end of the stream.  Blocks are decoded straight into 'dst' as in 
+// 'db_read()', which saves most of the copying for large reads.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_read_some(dbuf_t *db, void *dst, int length) {
+  uint8_t *out = (uint8_t *)dst;
+  int total = 0;
+  size_t direct = 0;
+  
+  while (total < length) {
+    if (db->pos == db->data_length) {
+      if (db->at_end) break;
+      int comp_len = db_read_block(db);
+      if (comp_len < 0) {
+        if (!db->at_end) return DB_ERROR;
+        break;
+      }
+      
+      if (db->block_len > 0 && db->block_len <= length - total) {
+        if (db_direct_block(db, comp_len, out + total) < 0) return DB_ERROR;
+        total  += db->block_len;
+        direct += db->block_len;
+      } else {
+        if (direct > 0) db_keep_history(db, out + total, direct);
+        direct = 0;
+        if (db_buffer_block(db, comp_len) < 0) return DB_ERROR;
+      }
+      continue;
+    }
+    
+    int n = length - total;
+    if (n > db->data_length - db->pos) n = db->data_length - db->pos;
+    memcpy(out + total, db->buf[db->idx] + db->pos, n);
+    db->pos += n;
+    total   += n;
+  }
+  
+  if (direct > 0) db_keep_history(db, out + total, direct);
+  return total;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Is there nothing left to read? 
+// The next block is loaded (if needed) to find out, so this works for 
+// files and connections which can't be peeked.
+// Returns 1 at the end, 0 if there is more data, or DB_ERROR
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int db_at_end(dbuf_t *db) {
+  while (db->pos == db->data_length) {
+    if (db->at_end) return 1;
+    if (db_next_block(db) < 0) return db->at_end ? 1 : DB_ERROR;
+  }
+  return 0;
+}
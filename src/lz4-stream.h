@@ -0,0 +1,150 @@
+#ifndef LZ4_STREAM_H
+#define LZ4_STREAM_H
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The LZ4T stream format, independent of R.
+//
+//   STREAM_MAGIC followed by blocks of:
+//      - 4 bytes: uncompressed length of block. The top byte holds the
+//                 block type (BLOCK_*)
+//      - 4 bytes: compressed length of block
+//      - compressed data
+//
+// Consecutive LZ4 blocks share compression history.  Any other type of 
+// block resets the history, on both sides.  Functions return
+// DB_ERROR on failure and set 'errmsg', so that callers can raise errors in
+// their own way.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lz4.h"
+#include "lz4-stats.h"
+
+#define DB_ERROR -1
+
+#define BUF_SIZE (512 * 1024)
+
+// LZ4 matches never reach further back than this
+#define HIST_SIZE (64 * 1024)
+
+// Smallest block size a codec may request
+#define MIN_BLOCK_SIZE (4 * 1024)
+
+// Range of acceleration when adapting to 'target_mbps'
+#define ACC_MIN 1
+#define ACC_MAX 65535
+
+// Streams start with STREAM_MAGIC.  lz4lite 1.0.0 wrote "LZ4S" streams, 
+// which only hold LZ4 blocks, and can't read the other block types.  The 
+// magic was changed when they were added, so that older versions refuse
+// these streams outright rather than failing part way through with a 
+// decompression error.  "LZ4S" streams are still read.
+#define STREAM_MAGIC    "LZ4T"
+#define STREAM_MAGIC_V1 "LZ4S"
+
+// Block types, held in the top byte of the uncompressed length
+#define BLOCK_TYPE_SHIFT 24
+#define BLOCK_LEN_MASK   0x00FFFFFF
+#define BLOCK_LZ4 0   // LZ4 compressed
+#define BLOCK_RLE 1   // Runs plus LZ4 compressed literals. See 'lz4-rle.h'
+#define BLOCK_STORED 2  // Uncompressed, for incompressible data
+
+// Source / Destination mode
+#define MODE_RAW      1
+#define MODE_FILE     2
+#define MODE_CALLBACK 4  // I/O through 'io_write'/'io_read' e.g. R connections
+
+// Direction modes
+#define MODE_UNSERIALIZE   8
+#define MODE_SERIALIZE    16                                           
+
+
+
+struct lz4_codec_st;
+
+typedef struct {
+  int mode;
+  
+  // For file output
+  FILE *file;
+  
+  // For callback I/O. Return the number of bytes transferred, which is 
+  // only less than 'n' on error or end of input
+  size_t (*io_write)(void *io_ctx, const void *src, size_t n);
+  size_t (*io_read) (void *io_ctx, void *dst, size_t n);
+  void *io_ctx;
+  
+  // For raw vector output
+  uint8_t *raw;
+  int raw_capacity;
+  int raw_pos;
+  
+  // Output buffer kept between uses of this context. 
+  // 'raw' points here when serializing to a raw vector
+  uint8_t *out;
+  int out_capacity;
+  
+  // Double buffer state
+  int idx;              // which buffer is active
+  uint32_t pos;         // position within active buffer
+  uint32_t data_length; // total data length in active buffer (for reading)
+  uint32_t block_len;   // uncompressed length of the block just read
+  int block_type;       // type of the block just compressed or read
+  
+  // For LZ4
+  LZ4_stream_t       *stream_out;  // compression
+  LZ4_streamDecode_t *stream_in;   // decompression
+  int acceleration;                // range [1, 65535]
+  double target_mbps;              // If > 0, adapt 'acceleration' per block to meet this
+  uint8_t *comp;                   // compressed buffer
+  int comp_capacity;               // capacity of compressed buffer
+  uint8_t *scratch;                // BUF_SIZE bytes for run-length encoding
+  
+  bool checked_magic;
+  bool magic_v1;        // Stream is from lz4lite 1.0.0, so only has LZ4 blocks
+  bool at_end;          // Input ended cleanly at a block boundary
+  
+  // Target size of each uncompressed block when writing. [MIN_BLOCK_SIZE, BUF_SIZE]
+  int block_size;
+  
+  // The codec which owns this context. NULL for pooled contexts
+  struct lz4_codec_st *owner;
+  
+  // Performance stats for the current call. NULL when not collecting
+  lz4_stats_t *stats;
+  
+  // Message for the last error i.e. when a function returned DB_ERROR
+  char errmsg[256];
+  
+  // Double buffers. Last so that they never need to be zeroed.
+  uint8_t buf[2][BUF_SIZE];
+} dbuf_t;
+
+
+dbuf_t *db_new(void);
+void    db_free(dbuf_t *db);
+int     db_reset(dbuf_t *db, int mode);
+int     db_set_error(dbuf_t *db, const char *fmt, ...);
+
+int db_raw_begin(dbuf_t *db);
+int db_check_magic(const void *src);
+bool lz4_incompressible(const uint8_t *src, int len);
+
+int db_write_magic(dbuf_t *db);
+int db_compress_block(dbuf_t *db);
+uint32_t db_block_header(dbuf_t *db);
+const uint8_t *db_block_data(dbuf_t *db);
+int db_write_block(dbuf_t *db);
+int db_write(dbuf_t *db, const void *src, int length);
+int db_write_all(dbuf_t *db, const void *src, size_t length);
+
+int db_read_block(dbuf_t *db);
+int db_decompress_block(dbuf_t *db, int comp_len, uint8_t *dst, int dst_capacity);
+int db_read(dbuf_t *db, void *dst, int length);
+int db_read_some(dbuf_t *db, void *dst, int length);
+int db_at_end(dbuf_t *db);
+
+#endif
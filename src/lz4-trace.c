@@ -0,0 +1,145 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "lz4-trace.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// USDT semaphores.  A tracer increments these when it attaches to a probe
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#ifdef LZ4LITE_HAVE_SDT
+#define SEMAPHORE __attribute__((section(".probes"), used))
+unsigned short lz4lite_stream_compress_semaphore   SEMAPHORE;
+unsigned short lz4lite_stream_decompress_semaphore SEMAPHORE;
+unsigned short lz4lite_compress_semaphore          SEMAPHORE;
+unsigned short lz4lite_decompress_semaphore        SEMAPHORE;
+#endif
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Event recorder.  
+//
+// A fixed capacity array, so recording never allocates on the hot path.
+// Events past the capacity are dropped and counted.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  int      event;
+  int      tid;     // thread the event was recorded on
+  uint64_t start;   // ns
+  uint64_t ns;      // duration
+  int64_t  raw_len;
+  int64_t  comp_len;
+} trace_event_t;
+
+static const char *trace_names[] = {
+  "stream_compress", "stream_decompress", "compress", "decompress",
+  "serialize", "unserialize", "lz4_compress", "lz4_decompress"
+};
+
+bool lz4_trace_recording = false;
+
+static trace_event_t *trace_events   = NULL;
+static int            trace_capacity = 0;
+static int            trace_n        = 0;
+static int            trace_dropped  = 0;
+
+// Threads are numbered from 1 in the order they first record an event
+static int              trace_nthreads = 0;
+static _Thread_local int trace_tid     = 0;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Start recording. Any previously recorded events are discarded.
+// Returns -1 if the event buffer could not be allocated
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int lz4_trace_start(int max_events) {
+  lz4_trace_free();
+  trace_events = malloc((size_t)max_events * sizeof(trace_event_t));
+  if (trace_events == NULL) {
+    return -1;
+  }
+  trace_capacity      = max_events;
+  lz4_trace_recording = true;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Blocks may be decompressed on several threads at once (see 
+// 'lz4-archive.c'), so appending an event is a critical section.  Each
+// event keeps its thread, so that overlapping events are shown on 
+// separate tracks rather than as broken nesting
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void lz4_trace_record(int event, uint64_t start, uint64_t ns, int64_t raw_len, int64_t comp_len) {
+#ifdef _OPENMP
+#pragma omp critical(lz4_trace)
+#endif
+  {
+    if (trace_tid == 0) {
+      trace_tid = ++trace_nthreads;
+    }
+    if (trace_n >= trace_capacity) {
+      trace_dropped++;
+    } else {
+      trace_events[trace_n++] = (trace_event_t){event, trace_tid, start, ns, raw_len, comp_len};
+    }
+  }
+}
+
+
+void lz4_trace_free(void) {
+  free(trace_events);
+  trace_events        = NULL;
+  trace_capacity      = 0;
+  trace_n             = 0;
+  trace_dropped       = 0;
+  lz4_trace_recording = false;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Stop recording and write all events as Chrome trace JSON.
+//
+// Timestamps are relative to the first event.
+// Returns the number of events written, or -1 if the file couldn't be written
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int lz4_trace_write(const char *filename, int *dropped) {
+  lz4_trace_recording = false;
+  *dropped = trace_dropped;
+  
+  FILE *fp = fopen(filename, "w");
+  if (fp == NULL) {
+    lz4_trace_free();
+    return -1;
+  }
+  
+  uint64_t t0 = trace_n > 0 ? trace_events[0].start : 0;
+  for (int i = 0; i < trace_n; i++) {
+    if (trace_events[i].start < t0) t0 = trace_events[i].start;
+  }
+  
+  int pid = (int)getpid();
+  fprintf(fp, "{\"traceEvents\":[\n");
+  for (int i = 0; i < trace_n; i++) {
+    trace_event_t *ev = &trace_events[i];
+    double ratio = ev->comp_len > 0 ? (double)ev->raw_len / ev->comp_len : 0;
+    fprintf(fp, 
+      "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+      "\"pid\":%i,\"tid\":%i,\"args\":{\"raw_len\":%lld,\"comp_len\":%lld,\"ratio\":%.3f}}%s\n",
+      trace_names[ev->event], ev->event >= TRACE_CALL_SERIALIZE ? "call" : "block",
+      (ev->start - t0) / 1e3, ev->ns / 1e3, pid, ev->tid, 
+      (long long)ev->raw_len, (long long)ev->comp_len, ratio,
+      i == trace_n - 1 ? "" : ","
+    );
+  }
+  fprintf(fp, "],\n\"displayTimeUnit\":\"ns\",\n\"otherData\":{\"dropped\":%i}}\n", trace_dropped);
+  
+  int n = trace_n;
+  int status = fclose(fp);
+  lz4_trace_free();
+  
+  return status == 0 ? n : -1;
+}
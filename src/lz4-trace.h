@@ -0,0 +1,84 @@
+#ifndef LZ4_TRACE_H
+#define LZ4_TRACE_H
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Tracing of block compress/decompress events.
+//
+// Two independent consumers:
+//
+//   - USDT probes (Linux, when <sys/sdt.h> is available at build time).
+//     Provider 'lz4lite', probes:
+//         stream_compress, stream_decompress, compress, decompress
+//     Each with arguments: (raw_len, comp_len, duration_ns)
+//     e.g. bpftrace -e 'usdt:lz4lite.so:lz4lite:stream_compress { @ns = hist(arg2); }'
+//     Probes use semaphores, so blocks are only timed while a tracer is 
+//     attached.
+//
+//   - An in-memory event recorder, which is written out as Chrome trace 
+//     JSON ('chrome://tracing' or Perfetto) by 'lz4_trace_stop()'
+//
+// Build with -DLZ4LITE_NO_SDT to leave out the USDT probes.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(__linux__) && !defined(LZ4LITE_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define LZ4LITE_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef LZ4LITE_HAVE_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+extern unsigned short lz4lite_stream_compress_semaphore;
+extern unsigned short lz4lite_stream_decompress_semaphore;
+extern unsigned short lz4lite_compress_semaphore;
+extern unsigned short lz4lite_decompress_semaphore;
+
+#define TRACE_SDT_ENABLED(probe) (lz4lite_##probe##_semaphore != 0)
+#define TRACE_SDT_PROBE(probe, raw_len, comp_len, ns) \
+  DTRACE_PROBE3(lz4lite, probe, raw_len, comp_len, ns)
+#else
+#define TRACE_SDT_ENABLED(probe) 0
+#define TRACE_SDT_PROBE(probe, raw_len, comp_len, ns) do {} while (0)
+#endif
+
+
+// Events recorded for the Chrome trace. Block events, then whole calls
+#define TRACE_STREAM_COMPRESS    0
+#define TRACE_STREAM_DECOMPRESS  1
+#define TRACE_COMPRESS           2
+#define TRACE_DECOMPRESS         3
+#define TRACE_CALL_SERIALIZE     4
+#define TRACE_CALL_UNSERIALIZE   5
+#define TRACE_CALL_COMPRESS      6
+#define TRACE_CALL_DECOMPRESS    7
+
+extern bool lz4_trace_recording;
+
+int  lz4_trace_start(int max_events);
+void lz4_trace_record(int event, uint64_t start, uint64_t ns, int64_t raw_len, int64_t comp_len);
+int  lz4_trace_write(const char *filename, int *dropped);
+void lz4_trace_free(void);
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Should a block event be timed?
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define TRACE_ACTIVE(probe) (lz4_trace_recording || TRACE_SDT_ENABLED(probe))
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Fire the USDT probe and record the event for a completed block
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define TRACE_BLOCK(probe, event, start, ns, raw_len, comp_len) do {  \
+  TRACE_SDT_PROBE(probe, raw_len, comp_len, ns);                       \
+  if (lz4_trace_recording) {                                           \
+    lz4_trace_record(event, start, ns, raw_len, comp_len);             \
+  }                                                                    \
+} while (0)
+
+#endif
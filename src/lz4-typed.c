@@ -0,0 +1,671 @@
+
+#define R_NO_REMAP
+
+#include <R.h>
+#include <Rinternals.h>
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4-typed.h"
+#include "lz4-bitpack.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Values are XOR'd in chunks so the XOR pass has no loop-carried 
+// dependency and can be vectorised
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define XOR_CHUNK 1024
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The 'auto' filter chooses the sparse filter for vectors of at least 
+// SPARSE_MIN_N elements where one value makes up SPARSE_MIN_PERCENT of them
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define SPARSE_MIN_N       128
+#define SPARSE_MIN_PERCENT  70
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Little-endian load/store of the low 'nbytes' of a 64-bit value.
+// 'put_le64' always writes 8 bytes, so 'dst' needs 8 bytes of room.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline void put_le64(char *dst, uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(dst, &v, sizeof(v));
+#else
+  for (int k = 0; k < 8; k++) {
+    dst[k] = (char)(v >> (8 * k));
+  }
+#endif
+}
+
+
+static inline uint64_t get_le(const char *src, int nbytes, const char *end) {
+  uint64_t v = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (end - src >= 8) {
+    memcpy(&v, src, sizeof(v));
+    return nbytes == 8 ? v : v & ((UINT64_C(1) << (8 * nbytes)) - 1);
+  }
+#endif
+  for (int k = 0; k < nbytes; k++) {
+    v |= (uint64_t)(uint8_t)src[k] << (8 * k);
+  }
+  return v;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Can this vector be written as a typed frame?
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int typed_supported(SEXP x_) {
+  return TYPEOF(x_) == STRSXP || TYPEOF(x_) == REALSXP || TYPEOF(x_) == INTSXP;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Bits of element 'i' of a double (size 8) or integer (size 4) vector
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline uint64_t elt_bits(const char *x, size_t size, size_t i) {
+  if (size == sizeof(uint64_t)) {
+    uint64_t v;
+    memcpy(&v, x + i * size, sizeof(v));
+    return v;
+  } else {
+    uint32_t v;
+    memcpy(&v, x + i * size, sizeof(v));
+    return v;
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The sparse filter's common value for 'x_': the most frequent of zero, NA
+// and the first element, compared bitwise.  Returns the number of elements 
+// which differ from it.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t sparse_base(SEXP x_, uint64_t *base) {
+  size_t n    = (size_t)Rf_xlength(x_);
+  size_t size = TYPEOF(x_) == REALSXP ? sizeof(double) : sizeof(int32_t);
+  const char *x = (const char *)DATAPTR(x_);
+  
+  uint64_t cand[3] = {0, 0, n > 0 ? elt_bits(x, size, 0) : 0};
+  if (TYPEOF(x_) == REALSXP) {
+    double na = NA_REAL;
+    memcpy(&cand[1], &na, sizeof(na));
+  } else {
+    cand[1] = (uint32_t)NA_INTEGER;
+  }
+  
+  size_t count[3] = {0, 0, 0};
+  for (size_t i = 0; i < n; i++) {
+    uint64_t v = elt_bits(x, size, i);
+    count[0] += v == cand[0];
+    count[1] += v == cand[1];
+    count[2] += v == cand[2];
+  }
+  
+  int best = 0;
+  for (int k = 1; k < 3; k++) {
+    if (count[k] > count[best]) best = k;
+  }
+  *base = cand[best];
+  return n - count[best];
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Resolve the user's choice of filter for 'x_'.
+// @param filter_ NULL or one of "auto", "none", "xor", "bitpack", "sparse"
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typed_filter_t typed_filter(SEXP x_, SEXP filter_) {
+  typed_filter_t res = {.filter = TYPED_FILTER_NONE, .base = 0, .nexcept = 0};
+  int filter = TYPED_FILTER_AUTO;
+  if (!Rf_isNull(filter_)) {
+    if (TYPEOF(filter_) != STRSXP || Rf_length(filter_) != 1) {
+      Rf_error("'filter' must be a single string");
+    }
+    const char *name = CHAR(STRING_ELT(filter_, 0));
+    if (strcmp(name, "auto") == 0) {
+      filter = TYPED_FILTER_AUTO;
+    } else if (strcmp(name, "none") == 0) {
+      filter = TYPED_FILTER_NONE;
+    } else if (strcmp(name, "xor") == 0) {
+      filter = TYPED_FILTER_XOR;
+    } else if (strcmp(name, "bitpack") == 0) {
+      filter = TYPED_FILTER_BITPACK;
+    } else if (strcmp(name, "sparse") == 0) {
+      filter = TYPED_FILTER_SPARSE;
+    } else {
+      Rf_error("Unknown filter: '%s'", name);
+    }
+  }
+
+  if (filter == TYPED_FILTER_AUTO) {
+    if ((TYPEOF(x_) == REALSXP || TYPEOF(x_) == INTSXP) && Rf_xlength(x_) >= SPARSE_MIN_N) {
+      res.nexcept = sparse_base(x_, &res.base);
+      if (res.nexcept <= (size_t)Rf_xlength(x_) / 100 * (100 - SPARSE_MIN_PERCENT)) {
+        res.filter = TYPED_FILTER_SPARSE;
+        return res;
+      }
+    }
+    switch (TYPEOF(x_)) {
+    case REALSXP: res.filter = TYPED_FILTER_XOR;     break;
+    case INTSXP : res.filter = TYPED_FILTER_BITPACK; break;
+    default     : res.filter = TYPED_FILTER_NONE;    break;
+    }
+    return res;
+  }
+  if (filter == TYPED_FILTER_XOR && TYPEOF(x_) != REALSXP) {
+    Rf_error("Filter 'xor' is only for double vectors");
+  }
+  if (filter == TYPED_FILTER_BITPACK && TYPEOF(x_) != INTSXP) {
+    Rf_error("Filter 'bitpack' is only for integer vectors and factors");
+  }
+  if (filter == TYPED_FILTER_SPARSE && TYPEOF(x_) != REALSXP && TYPEOF(x_) != INTSXP) {
+    Rf_error("Filter 'sparse' is only for numeric and integer vectors");
+  }
+  
+  res.filter = filter;
+  if (filter == TYPED_FILTER_SPARSE) {
+    res.nexcept = sparse_base(x_, &res.base);
+  }
+  return res;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Maximum number of bytes needed for the encoded body of 'x_'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t body_bound(SEXP x_, const typed_filter_t *filter) {
+  size_t n = (size_t)Rf_xlength(x_);
+
+  if (TYPEOF(x_) == STRSXP) {
+    size_t size = n * (sizeof(int32_t) + 1);
+    for (size_t i = 0; i < n; i++) {
+      SEXP s_ = STRING_ELT(x_, (R_xlen_t)i);
+      if (s_ != NA_STRING) {
+        size += (size_t)LENGTH(s_);
+      }
+    }
+    return size;
+  } else if (filter->filter == TYPED_FILTER_SPARSE) {
+    size_t nexcept = filter->nexcept;
+    size_t size = TYPEOF(x_) == REALSXP ? sizeof(double) : sizeof(int32_t);
+    return sizeof(uint64_t) + 2 * sizeof(int32_t) + bitpack_bound((int)nexcept) + nexcept * size;
+  } else if (TYPEOF(x_) == INTSXP) {
+    return filter->filter == TYPED_FILTER_BITPACK ? bitpack_bound((int)n) : n * sizeof(int32_t);
+  } else if (filter->filter == TYPED_FILTER_XOR) {
+    return n * (sizeof(double) + 1) + sizeof(uint64_t);
+  } else {
+    return n * sizeof(double);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Does 'x_' fit within a single typed frame?
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int typed_fits(SEXP x_, const typed_filter_t *filter) {
+  return typed_supported(x_) && Rf_xlength(x_) <= INT_MAX / 16 &&
+    body_bound(x_, filter) <= INT_MAX - TYPED_HEADER_SIZE;
+}
+
+
+size_t typed_body_bound(SEXP x_, const typed_filter_t *filter) {
+  if (!typed_supported(x_)) {
+    Rf_error("Typed encoding not supported for type: %s", Rf_type2char(TYPEOF(x_)));
+  }
+  if (Rf_xlength(x_) > INT_MAX / 16) {
+    Rf_error("Vector too long for typed encoding: %.0f elements", (double)Rf_xlength(x_));
+  }
+
+  size_t size = body_bound(x_, filter);
+  if (size > INT_MAX - TYPED_HEADER_SIZE) {
+    Rf_error("Vector too large for typed encoding: %.0f bytes", (double)size);
+  }
+
+  return size;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Strings
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t string_encode(SEXP x_, char *dst) {
+  int n = (int)Rf_xlength(x_);
+
+  char *lens = dst;
+  uint8_t *enc = (uint8_t *)(dst + (size_t)n * sizeof(int32_t));
+  char *blob = (char *)enc + n;
+
+  for (int i = 0; i < n; i++) {
+    SEXP s_ = STRING_ELT(x_, i);
+    int32_t len;
+    if (s_ == NA_STRING) {
+      len    = -1;
+      enc[i] = 0;
+    } else {
+      len    = LENGTH(s_);
+      enc[i] = (uint8_t)Rf_getCharCE(s_);
+      memcpy(blob, CHAR(s_), (size_t)len);
+      blob += len;
+    }
+    memcpy(lens + (size_t)i * sizeof(int32_t), &len, sizeof(int32_t));
+  }
+
+  return (size_t)(blob - dst);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// All CHARSXPs are created in a single pass over the blob. A run of equal
+// strings re-uses the previous CHARSXP instead of looking it up again in
+// R's global string cache.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP string_decode(int n, const char *src, size_t len) {
+  if ((size_t)n * (sizeof(int32_t) + 1) > len) {
+    Rf_error("Typed frame is corrupt: body too short for %i elements", n);
+  }
+
+  const char *lens = src;
+  const uint8_t *enc = (const uint8_t *)(src + (size_t)n * sizeof(int32_t));
+  const char *blob = (const char *)enc + n;
+  const char *end  = src + len;
+
+  SEXP x_ = PROTECT(Rf_allocVector(STRSXP, n));
+
+  SEXP prev_ = NA_STRING;
+  const char *prev = NULL;
+  int32_t prev_len = -1;
+  uint8_t prev_enc = 0;
+
+  for (int i = 0; i < n; i++) {
+    int32_t slen;
+    memcpy(&slen, lens + (size_t)i * sizeof(int32_t), sizeof(int32_t));
+    if (slen == -1) {
+      SET_STRING_ELT(x_, i, NA_STRING);
+      continue;
+    }
+    if (slen < 0 || slen > end - blob) {
+      Rf_error("Typed frame is corrupt: bad string length at element %i", i + 1);
+    }
+    if (enc[i] > CE_BYTES) {
+      Rf_error("Typed frame is corrupt: bad encoding at element %i", i + 1);
+    }
+
+    if (prev != NULL && slen == prev_len && enc[i] == prev_enc &&
+        memcmp(blob, prev, (size_t)slen) == 0) {
+      SET_STRING_ELT(x_, i, prev_);
+    } else {
+      prev_    = Rf_mkCharLenCE(blob, slen, (cetype_t)enc[i]);
+      prev     = blob;
+      prev_len = slen;
+      prev_enc = enc[i];
+      SET_STRING_ELT(x_, i, prev_);
+    }
+    blob += slen;
+  }
+
+  if (blob != end) {
+    Rf_error("Typed frame is corrupt: %i trailing bytes", (int)(end - blob));
+  }
+
+  UNPROTECT(1);
+  return x_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Doubles: XOR with the previous value.
+//
+// Slowly changing values share their sign, exponent and leading mantissa
+// bits with the previous value, so the XOR has leading zero bytes, and
+// values with short decimal representations often have trailing zero 
+// bytes.  Only the bytes in between are kept.  Unlike Gorilla, this works
+// on whole bytes so that the output is still a good input for LZ4.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t xor_encode(const double *x, int n, char *dst) {
+  uint8_t *ctrl = (uint8_t *)dst;
+  char *out = dst + n;
+
+  uint64_t v[XOR_CHUNK + 1];
+  uint64_t delta[XOR_CHUNK];
+  v[XOR_CHUNK] = 0;
+
+  for (int i0 = 0; i0 < n; i0 += XOR_CHUNK) {
+    int m = n - i0 < XOR_CHUNK ? n - i0 : XOR_CHUNK;
+
+    // v[0] is the last value of the previous chunk
+    v[0] = v[XOR_CHUNK];
+    memcpy(v + 1, x + i0, (size_t)m * sizeof(double));
+    for (int j = 0; j < m; j++) {
+      delta[j] = v[j + 1] ^ v[j];
+    }
+    v[XOR_CHUNK] = v[m];
+
+    for (int j = 0; j < m; j++) {
+      uint64_t d = delta[j];
+      if (d == 0) {
+        *ctrl++ = 0;
+        continue;
+      }
+      int lz = __builtin_clzll(d) >> 3;
+      int tz = __builtin_ctzll(d) >> 3;
+      int nbytes = 8 - lz - tz;
+      *ctrl++ = (uint8_t)(lz << 4 | nbytes);
+      put_le64(out, d >> (8 * tz));
+      out += nbytes;
+    }
+  }
+
+  return (size_t)(out - dst);
+}
+
+
+static const char *xor_decode(double *x, int n, const char *src, size_t len) {
+  if ((size_t)n > len) {
+    return "Typed frame is corrupt: body too short";
+  }
+
+  const uint8_t *ctrl = (const uint8_t *)src;
+  const char *in  = src + n;
+  const char *end = src + len;
+
+  uint64_t prev = 0;
+  for (int i = 0; i < n; i++) {
+    int lz     = ctrl[i] >> 4;
+    int nbytes = ctrl[i] & 0x0f;
+    if (nbytes > 0) {
+      if (lz + nbytes > 8 || nbytes > end - in) {
+        return "Typed frame is corrupt: bad XOR control";
+      }
+      int tz = 8 - lz - nbytes;
+      prev ^= get_le(in, nbytes, end) << (8 * tz);
+      in += nbytes;
+    }
+    memcpy(x + i, &prev, sizeof(double));
+  }
+
+  if (in != end) {
+    return "Typed frame is corrupt: trailing bytes";
+  }
+  return NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Sparse doubles/integers: a common value plus exceptions.
+//
+// Vectors which are mostly zero or NA (or any one repeated value) are
+// stored as that value, the gaps between the other elements (bit-packed) 
+// and the other elements themselves.  Decoding is a fill followed by a 
+// scatter of the exceptions.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t sparse_encode(SEXP x_, const typed_filter_t *filter, char *dst) {
+  int n       = (int)Rf_xlength(x_);
+  size_t size = TYPEOF(x_) == REALSXP ? sizeof(double) : sizeof(int32_t);
+  const char *x = (const char *)DATAPTR(x_);
+  
+  uint64_t base    = filter->base;
+  int32_t  nexcept = (int32_t)filter->nexcept;
+  int32_t *gaps = (int32_t *)R_alloc((size_t)nexcept + 1, sizeof(int32_t));
+  
+  char *values = dst + sizeof(uint64_t) + 2 * sizeof(int32_t) + bitpack_bound(nexcept);
+  char *out = values;
+  int k = 0, prev = -1;
+  for (int i = 0; i < n; i++) {
+    if (elt_bits(x, size, (size_t)i) != base) {
+      gaps[k++] = i - prev - 1;
+      prev = i;
+      memcpy(out, x + (size_t)i * size, size);
+      out += size;
+    }
+  }
+  
+  put_le64(dst, base);
+  memcpy(dst + sizeof(uint64_t), &nexcept, sizeof(int32_t));
+  char *packed = dst + sizeof(uint64_t) + 2 * sizeof(int32_t);
+  int32_t packed_len = (int32_t)bitpack_encode(gaps, nexcept, packed);
+  memcpy(dst + sizeof(uint64_t) + sizeof(int32_t), &packed_len, sizeof(int32_t));
+  
+  // Close the gap left by the bound on the packed length
+  memmove(packed + packed_len, values, (size_t)(out - values));
+  return (size_t)(packed + packed_len - dst) + (size_t)(out - values);
+}
+
+
+static const char *sparse_decode(char *x, size_t size, int n, const char *src, size_t len) {
+  size_t fixed = sizeof(uint64_t) + 2 * sizeof(int32_t);
+  int32_t nexcept, packed_len;
+  if (len < fixed) {
+    return "Typed frame is corrupt: body too short";
+  }
+  uint64_t base = get_le(src, 8, src + len);
+  memcpy(&nexcept   , src + sizeof(uint64_t)                  , sizeof(int32_t));
+  memcpy(&packed_len, src + sizeof(uint64_t) + sizeof(int32_t), sizeof(int32_t));
+  if (nexcept < 0 || nexcept > n || packed_len < 0 || 
+      (size_t)packed_len + (size_t)nexcept * size != len - fixed) {
+    return "Typed frame is corrupt: bad sparse header";
+  }
+  
+  // Fill
+  if (base == 0) {
+    memset(x, 0, (size_t)n * size);
+  } else if (size == sizeof(double)) {
+    for (int i = 0; i < n; i++) memcpy(x + (size_t)i * 8, &base, 8);
+  } else {
+    uint32_t b = (uint32_t)base;
+    for (int i = 0; i < n; i++) memcpy(x + (size_t)i * 4, &b, 4);
+  }
+  
+  // Scatter. Gaps are unpacked with 'malloc()' as this may run off the 
+  // main R thread
+  int32_t *gaps = malloc(((size_t)nexcept + 1) * sizeof(int32_t));
+  if (gaps == NULL) {
+    return "Couldn't allocate memory for sparse decoding";
+  }
+  const char *err = NULL;
+  if (bitpack_decode(gaps, nexcept, src + fixed, (size_t)packed_len) == BITPACK_ERROR) {
+    err = "Typed frame is corrupt: bad bit-packed data";
+  }
+  const char *values = src + fixed + packed_len;
+  int64_t i = -1;
+  for (int k = 0; err == NULL && k < nexcept; k++) {
+    i += (int64_t)gaps[k] + 1;
+    if (gaps[k] < 0 || i >= n) {
+      err = "Typed frame is corrupt: bad sparse index";
+    } else {
+      memcpy(x + (size_t)i * size, values + (size_t)k * size, size);
+    }
+  }
+  free(gaps);
+  return err;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write the body of 'x_' into 'dst', which must hold 
+// 'typed_body_bound(x_, filter)' bytes.  Returns the actual body length.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t typed_body_encode(SEXP x_, const typed_filter_t *filter, char *dst) {
+  int n = (int)Rf_xlength(x_);
+
+  switch (TYPEOF(x_)) {
+  case STRSXP:
+    return string_encode(x_, dst);
+  case REALSXP:
+    if (filter->filter == TYPED_FILTER_SPARSE) {
+      return sparse_encode(x_, filter, dst);
+    }
+    if (filter->filter == TYPED_FILTER_XOR) {
+      return xor_encode(REAL(x_), n, dst);
+    }
+    memcpy(dst, REAL(x_), (size_t)n * sizeof(double));
+    return (size_t)n * sizeof(double);
+  case INTSXP:
+    if (filter->filter == TYPED_FILTER_SPARSE) {
+      return sparse_encode(x_, filter, dst);
+    }
+    if (filter->filter == TYPED_FILTER_BITPACK) {
+      return bitpack_encode(INTEGER(x_), n, dst);
+    }
+    memcpy(dst, INTEGER(x_), (size_t)n * sizeof(int32_t));
+    return (size_t)n * sizeof(int32_t);
+  default:
+    Rf_error("Typed encoding not supported for type: %s", Rf_type2char(TYPEOF(x_)));
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decode the body of a numeric or integer vector into 'dst', which holds 
+// 'n' elements.  No R API is used, so this may run on worker threads.
+// Returns NULL on success, or a description of the problem.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+const char *typed_body_decode_into(int type, int filter, int n, const char *src, size_t len, void *dst) {
+  if (type == REALSXP) {
+    if (filter == TYPED_FILTER_XOR) {
+      return xor_decode((double *)dst, n, src, len);
+    } else if (filter == TYPED_FILTER_SPARSE) {
+      return sparse_decode((char *)dst, sizeof(double), n, src, len);
+    } else if (filter == TYPED_FILTER_NONE && len == (size_t)n * sizeof(double)) {
+      memcpy(dst, src, len);
+      return NULL;
+    }
+    return "Typed frame is corrupt: bad body length";
+  }
+
+  if (type == INTSXP) {
+    if (filter == TYPED_FILTER_BITPACK) {
+      if (bitpack_decode((int32_t *)dst, n, src, len) == BITPACK_ERROR) {
+        return "Typed frame is corrupt: bad bit-packed data";
+      }
+      return NULL;
+    } else if (filter == TYPED_FILTER_SPARSE) {
+      return sparse_decode((char *)dst, sizeof(int32_t), n, src, len);
+    } else if (filter == TYPED_FILTER_NONE && len == (size_t)n * sizeof(int32_t)) {
+      memcpy(dst, src, len);
+      return NULL;
+    }
+    return "Typed frame is corrupt: bad body length";
+  }
+
+  return "Typed frame has unsupported type/filter";
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Rebuild a vector of the given type from its encoded body.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP typed_body_decode(int type, int filter, int n, const char *src, size_t len) {
+  if (n < 0) {
+    Rf_error("Typed frame is corrupt: bad length %i", n);
+  }
+
+  if (type == STRSXP && filter == TYPED_FILTER_NONE) {
+    return string_decode(n, src, len);
+  }
+
+  if (type != REALSXP && type != INTSXP) {
+    Rf_error("Typed frame has unsupported type/filter: %i/%i", type, filter);
+  }
+
+  SEXP x_ = PROTECT(Rf_allocVector(type, n));
+  const char *err = typed_body_decode_into(type, filter, n, src, len, DATAPTR(x_));
+  if (err != NULL) {
+    Rf_error("%s", err);
+  }
+  UNPROTECT(1);
+  return x_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Header layout. See 'lz4-typed.h'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void typed_header_write(char *dst, const typed_header_t *hdr) {
+  dst[0] = 'L';
+  dst[1] = 'Z';
+  dst[2] = '4';
+  dst[3] = 'T';
+  dst[4] = (char)hdr->type;
+  dst[5] = (char)hdr->filter;
+  dst[6] = (char)hdr->flags;
+  dst[7] = 0;
+  memcpy(dst +  8, &hdr->n       , sizeof(int32_t));
+  memcpy(dst + 12, &hdr->raw_len , sizeof(int32_t));
+  memcpy(dst + 16, &hdr->comp_len, sizeof(int32_t));
+}
+
+
+void typed_header_read(const char *src, R_xlen_t len, typed_header_t *hdr) {
+  if (len < TYPED_HEADER_SIZE ||
+      src[0] != 'L' || src[1] != 'Z' || src[2] != '4' || src[3] != 'T') {
+    Rf_error("Buffer is not a typed frame. 'LZ4T' expected as header");
+  }
+
+  hdr->type   = (uint8_t)src[4];
+  hdr->filter = (uint8_t)src[5];
+  hdr->flags  = (uint8_t)src[6];
+  memcpy(&hdr->n       , src +  8, sizeof(int32_t));
+  memcpy(&hdr->raw_len , src + 12, sizeof(int32_t));
+  memcpy(&hdr->comp_len, src + 16, sizeof(int32_t));
+
+  if (hdr->n < 0 || hdr->raw_len < 0 || hdr->comp_len != len - TYPED_HEADER_SIZE) {
+    Rf_error("Typed frame is corrupt: bad header");
+  }
+  if (hdr->filter > TYPED_FILTER_SPARSE) {
+    Rf_error("Typed frame uses unknown filter: %i", hdr->filter);
+  }
+  if ((hdr->flags & TYPED_FLAG_STORED) && hdr->raw_len != hdr->comp_len) {
+    Rf_error("Typed frame is corrupt: stored length mismatch");
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A typed frame with the body stored uncompressed.  Used within serialized
+// streams where the whole stream is compressed anyway.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP typed_frame_stored(SEXP x_, const typed_filter_t *filter) {
+  size_t bound = typed_body_bound(x_, filter);
+
+  SEXP frame_ = PROTECT(Rf_allocVector(RAWSXP, (R_xlen_t)(bound + TYPED_HEADER_SIZE)));
+  char *dst = (char *)RAW(frame_);
+
+  size_t body_size = typed_body_encode(x_, filter, dst + TYPED_HEADER_SIZE);
+  typed_header_t hdr = {
+    .type     = (uint8_t)TYPEOF(x_),
+    .filter   = (uint8_t)filter->filter,
+    .flags    = TYPED_FLAG_STORED,
+    .n        = (int32_t)Rf_xlength(x_),
+    .raw_len  = (int32_t)body_size,
+    .comp_len = (int32_t)body_size
+  };
+  typed_header_write(dst, &hdr);
+
+  if (body_size < bound) {
+    frame_ = Rf_lengthgets(frame_, (R_len_t)(body_size + TYPED_HEADER_SIZE));
+  }
+
+  UNPROTECT(1);
+  return frame_;
+}
+
+
+SEXP typed_frame_unstore(SEXP frame_) {
+  if (TYPEOF(frame_) != RAWSXP) {
+    Rf_error("Typed frame must be a raw vector");
+  }
+
+  const char *src = (const char *)RAW(frame_);
+  typed_header_t hdr;
+  typed_header_read(src, Rf_xlength(frame_), &hdr);
+  if (!(hdr.flags & TYPED_FLAG_STORED)) {
+    Rf_error("Typed frame is compressed. Use 'lz4_decompress()'");
+  }
+
+  return typed_body_decode(hdr.type, hdr.filter, hdr.n, src + TYPED_HEADER_SIZE, (size_t)hdr.raw_len);
+}
@@ -0,0 +1,91 @@
+#ifndef LZ4_TYPED_H
+#define LZ4_TYPED_H
+
+#include <Rinternals.h>
+#include <stdint.h>
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Typed frames ('LZ4T') hold a vector in a native encoding rather than as
+// raw bytes, so that it can be rebuilt without going through R's
+// element-by-element serialization.
+//
+// Header (20 bytes), followed by 'comp_len' bytes of data
+//   - 4 bytes: magic 'LZ4T'
+//   - 1 byte : SEXPTYPE of the vector
+//   - 1 byte : filter applied to the body before LZ4 (TYPED_FILTER_*)
+//   - 1 byte : flags (TYPED_FLAG_*)
+//   - 1 byte : reserved
+//   - 4 bytes: number of elements
+//   - 4 bytes: length of the encoded body
+//   - 4 bytes: length of the data after the header
+//
+// STRSXP body
+//   - int32 lens[n]  byte length of each string. -1 for NA
+//   - uint8 enc[n]   encoding of each string (cetype_t)
+//   - all string bytes concatenated
+//
+// REALSXP body
+//   - TYPED_FILTER_NONE: the doubles as-is
+//   - TYPED_FILTER_XOR : each value XOR the previous value, with leading 
+//     and trailing zero bytes dropped.
+//       - uint8 ctrl[n]  (leading zero bytes << 4) | number of bytes kept
+//       - the kept bytes of each value, least significant first
+//
+// INTSXP body
+//   - TYPED_FILTER_NONE   : the integers as-is
+//   - TYPED_FILTER_BITPACK: frame-of-reference bit-packing in blocks of
+//     128 values. See 'lz4-bitpack.h'
+//
+// REALSXP/INTSXP body with TYPED_FILTER_SPARSE
+//   - 8 bytes : the common value (integers in the low 4 bytes)
+//   - int32   : number of other elements, k
+//   - int32   : length of the packed gaps
+//   - the k gaps between the other elements, bit-packed
+//   - the k other elements as-is
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define TYPED_HEADER_SIZE 20
+
+#define TYPED_FILTER_AUTO -1 // Choose the filter from the type
+#define TYPED_FILTER_NONE  0
+#define TYPED_FILTER_XOR   1
+#define TYPED_FILTER_BITPACK 2
+#define TYPED_FILTER_SPARSE  3
+
+#define TYPED_FLAG_STORED 1  // Body is stored without LZ4 compression
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The filter chosen for a vector.  For TYPED_FILTER_SPARSE this also holds
+// the common value and the number of other elements, so that the vector 
+// is only scanned for them once.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  int      filter;   // TYPED_FILTER_*
+  uint64_t base;     // sparse: the common value
+  size_t   nexcept;  // sparse: number of elements which differ from it
+} typed_filter_t;
+
+typedef struct {
+  uint8_t type;
+  uint8_t filter;
+  uint8_t flags;
+  int32_t n;
+  int32_t raw_len;
+  int32_t comp_len;
+} typed_header_t;
+
+
+int    typed_supported(SEXP x_);
+typed_filter_t typed_filter(SEXP x_, SEXP filter_);
+int    typed_fits(SEXP x_, const typed_filter_t *filter);
+size_t typed_body_bound(SEXP x_, const typed_filter_t *filter);
+size_t typed_body_encode(SEXP x_, const typed_filter_t *filter, char *dst);
+SEXP   typed_body_decode(int type, int filter, int n, const char *src, size_t len);
+const char *typed_body_decode_into(int type, int filter, int n, const char *src, size_t len, void *dst);
+
+void typed_header_write(char *dst, const typed_header_t *hdr);
+void typed_header_read(const char *src, R_xlen_t len, typed_header_t *hdr);
+
+SEXP typed_frame_stored(SEXP x_, const typed_filter_t *filter);
+SEXP typed_frame_unstore(SEXP frame_);
+
+#endif
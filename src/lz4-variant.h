@@ -0,0 +1,42 @@
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Build a private copy of 'lz4.c' for the compiler target 
+// LZ4LITE_VARIANT_TARGET and export its kernels as 
+// 'lz4_kernels_<LZ4LITE_VARIANT>'.
+//
+// All of lz4.c is made static, and the few functions it exports for lz4hc 
+// are renamed, so the copy doesn't clash with the baseline build.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#include "lz4-isa.h"
+
+#ifdef LZ4LITE_HAVE_DISPATCH
+
+#define LZ4_CONCAT_(a, b) a ## _ ## b
+#define LZ4_CONCAT(a, b)  LZ4_CONCAT_(a, b)
+#define LZ4_VARIANT_NAME(name) LZ4_CONCAT(name, LZ4LITE_VARIANT)
+
+#define LZ4LIB_VISIBILITY static __attribute__((unused))
+#define LZ4_PUBLISH_STATIC_FUNCTIONS
+
+#define LZ4_compress_forceExtDict                LZ4_VARIANT_NAME(LZ4_compress_forceExtDict)
+#define LZ4_decompress_safe_forceExtDict         LZ4_VARIANT_NAME(LZ4_decompress_safe_forceExtDict)
+#define LZ4_decompress_safe_partial_forceExtDict LZ4_VARIANT_NAME(LZ4_decompress_safe_partial_forceExtDict)
+#define LZ4_loadDict_internal                    LZ4_VARIANT_NAME(LZ4_loadDict_internal)
+#define LZ4_compress_destSize_extState           LZ4_VARIANT_NAME(LZ4_compress_destSize_extState)
+
+LZ4_TARGET_PUSH(LZ4LITE_VARIANT_TARGET)
+#include "lz4.c"
+LZ4_TARGET_POP
+
+#include "lz4-dispatch.h"
+
+const lz4_kernels_t LZ4_VARIANT_NAME(lz4_kernels) = {
+  .name                      = LZ4LITE_VARIANT_STRING,
+  .compress_fast             = LZ4_compress_fast,
+  .compress_fast_continue    = LZ4_compress_fast_continue,
+  .decompress_safe           = LZ4_decompress_safe,
+  .decompress_safe_continue  = LZ4_decompress_safe_continue,
+  .decompress_safe_usingDict = LZ4_decompress_safe_usingDict
+};
+
+#endif